@@ -18,8 +18,9 @@
 
 // Macro to advance either in_offs or out_offs and wrap if necessary. Returns
 // new value of offset.  Could be in header, but added here to limit changes
-// to one file.
-#define AESDCHAR_ADVANCE_PTR(x) (((x)+1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+// to one file.  The slot count is a power of two, so wrap with a mask
+// rather than a divide.
+#define AESDCHAR_ADVANCE_PTR(buffer,x) (((x)+1) & (buffer)->mask)
 
 /**
  * @param buffer the buffer to search for corresponding offset.  Any necessary locking must be performed by caller.
@@ -30,6 +31,8 @@
  *      in aesd_buffer.
  * @return the struct aesd_buffer_entry structure representing the position described by char_offset, or
  * NULL if this position is not available in the buffer (not enough data is written).
+ * Entries are contiguous in abs_offset, so this is a binary search for the last entry starting
+ * at or before char_offset.
  */
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
@@ -37,25 +40,57 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct
     /**
     * TODO: implement per description
     */
-    uint8_t out_offs;
+    struct aesd_buffer_entry *entry;
+    uint32_t low, high, mid;
+    uint64_t abs_offset;
 
     // Check for NULL inputs, return if so
     if ((!buffer) || (!entry_offset_byte_rtn)) {
 	return NULL;
     }
+    if (char_offset >= buffer->end_offset - buffer->base_offset) {
+	return NULL;
+    }
+    abs_offset = buffer->base_offset + char_offset;
 
-    out_offs = buffer->out_offs;
-    while (buffer->entry[out_offs].size <= char_offset)
-    {
-	char_offset -= buffer->entry[out_offs].size;
-	out_offs = AESDCHAR_ADVANCE_PTR(out_offs);
-	if (out_offs == buffer->in_offs) {
-	    return NULL;
+    // Find the first entry (by age) starting after abs_offset.  The one
+    // before it holds abs_offset; there is one, as the oldest starts at
+    // base_offset.
+    low = 0;
+    high = buffer->count;
+    while (low < high) {
+	mid = low + (high - low) / 2;
+	if (buffer->entry[(buffer->out_offs + mid) & buffer->mask].abs_offset <= abs_offset) {
+	    low = mid + 1;
+	} else {
+	    high = mid;
 	}
     }
 
-    *entry_offset_byte_rtn = char_offset;
-    return &(buffer->entry[out_offs]);
+    entry = &(buffer->entry[(buffer->out_offs + low - 1) & buffer->mask]);
+    *entry_offset_byte_rtn = abs_offset - entry->abs_offset;
+    return entry;
+}
+
+/**
+ * @param buffer the buffer to search.  Any necessary locking must be performed by caller.
+ * @param entry_index the zero referenced index of the entry to find, oldest first
+ * @param fpos_rtn is a pointer specifying a location to store the char offset of the first byte
+ *      of the entry, as for aesd_circular_buffer_find_entry_offset_for_fpos().  Only set when
+ *      the entry exists.
+ * @return the entry, or NULL if the buffer holds entry_index entries or fewer
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_find_fpos_for_entry(struct aesd_circular_buffer *buffer,
+            uint32_t entry_index, loff_t *fpos_rtn)
+{
+    struct aesd_buffer_entry *entry;
+
+    if ((!buffer) || (!fpos_rtn) || (entry_index >= buffer->count)) {
+	return NULL;
+    }
+    entry = &(buffer->entry[(buffer->out_offs + entry_index) & buffer->mask]);
+    *fpos_rtn = entry->abs_offset - buffer->base_offset;
+    return entry;
 }
 
 /**
@@ -81,35 +116,66 @@ const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 	return NULL;
     }
 
-    // Three possible states to handle:
-    //  1 - in_offs == out_offs, !full - ring empty, advance in_offs
-    //  2 - in_offs == out_offs, full - advance in_offs and out_offs
-    //      (discard oldest value) - but how do you deallocate lost buffptr?
-    //  3 - in_offs != out_offs, full==<don't care> - advance in_offs and
-    //      check for in_offs == out_offs AFTER increment.  Set full if so.
-    //
-    // If state 2, return buffptr about to be discarded so caller can deallocate
-    // advance out_offs, discarding entry.
-    // Need to advance both pointers after add.  Do out_offs here,
-    // in_offs is always done below.
-    if ((buffer->in_offs == buffer->out_offs) && buffer->full) {
-	ret_val = buffer->entry[buffer->out_offs].buffptr;
-	buffer->out_offs = AESDCHAR_ADVANCE_PTR(buffer->out_offs);
+    // The ring may have more slots than capacity, so fullness comes
+    // from count rather than in_offs meeting out_offs.  If already
+    // full, return buffptr about to be discarded so caller can
+    // deallocate, and advance out_offs, discarding entry.
+    if (buffer->count == buffer->capacity) {
+	ret_val = aesd_circular_buffer_remove_entry(buffer);
     }
 
     // First, write the new entry to the array at location in_offs
     buffer->entry[buffer->in_offs].buffptr = add_entry->buffptr;
     buffer->entry[buffer->in_offs].size    = add_entry->size;
+    buffer->entry[buffer->in_offs].abs_offset = buffer->end_offset;
+    buffer->end_offset += add_entry->size;
 
     // Advance in_off AFTER check above (analyze pre-insert state)
-    buffer->in_offs = AESDCHAR_ADVANCE_PTR(buffer->in_offs);
+    buffer->in_offs = AESDCHAR_ADVANCE_PTR(buffer, buffer->in_offs);
+    buffer->count++;
+    return ret_val;
+}
 
-    // Set flag if we just filled the buffer (in wrapped around to meet out)
-    // May have already been full, in which case this is a nop
-    if (buffer->in_offs == buffer->out_offs) {
-	buffer->full = true;
+/**
+* Removes the oldest entry from @param buffer.
+* Any necessary locking must be handled by the caller
+* Return NULL if the buffer is empty, else the value of buffptr for the entry which was
+* removed (for deallocation by the caller)
+*/
+const char *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *entry;
+
+    if ((!buffer) || (!buffer->count)) {
+	return NULL;
     }
-    return ret_val;
+    entry = &(buffer->entry[buffer->out_offs]);
+    buffer->out_offs = AESDCHAR_ADVANCE_PTR(buffer, buffer->out_offs);
+    buffer->count--;
+    buffer->base_offset += entry->size;
+    return entry->buffptr;
+}
+
+/**
+* Makes room in @param buffer for an entry of @param size bytes, by removing the oldest entry
+* if the buffer is full or adding the entry would take it over max_bytes.  Call until it returns
+* NULL, then aesd_circular_buffer_add_entry() won't overwrite anything.  An entry bigger than
+* max_bytes on its own empties the buffer, the caller should refuse it instead.
+* Any necessary locking must be handled by the caller
+* Return NULL if there is room, else the value of buffptr for the entry which was removed
+* (for deallocation by the caller)
+*/
+const char *aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t size)
+{
+    if ((!buffer) || (!buffer->count)) {
+	return NULL;
+    }
+    if ((buffer->count == buffer->capacity) ||
+	(buffer->max_bytes &&
+	 (buffer->end_offset - buffer->base_offset + size > buffer->max_bytes))) {
+	return aesd_circular_buffer_remove_entry(buffer);
+    }
+    return NULL;
 }
 
 /**
@@ -118,22 +184,103 @@ const char * aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->mask = AESDCHAR_DEFAULT_SLOTS - 1;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* Returns the number of slots (a power of two) needed for a buffer of @param capacity entries
+*/
+uint32_t aesd_circular_buffer_slots_for(uint32_t capacity)
+{
+    uint32_t slots = 1;
+
+    while (slots < capacity) {
+	slots <<= 1;
+    }
+    return slots;
+}
+
+/**
+* Copies the entries of @param buffer that fit in @param new_capacity, the newest ones, to the
+* start of @param new_entry, oldest first, ready for aesd_circular_buffer_resize() to switch to
+* it.  @param new_entry is as for aesd_circular_buffer_resize(), and if it's the array the buffer
+* already uses there's nothing to do.  Doing this first keeps the resize itself O(1).
+* Any necessary locking must be handled by the caller.  The buffer must not change in between.
+*/
+void aesd_circular_buffer_prepare_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *new_entry, uint32_t new_capacity)
+{
+    uint32_t index, dropped;
+
+    if (!new_entry) {
+	new_entry = buffer->default_entry;
+    }
+    if (new_entry == buffer->entry) {
+	return;
+    }
+    dropped = (buffer->count > new_capacity) ? buffer->count - new_capacity : 0;
+    for (index = dropped; index < buffer->count; index++) {
+	new_entry[index - dropped] = buffer->entry[(buffer->out_offs + index) & buffer->mask];
+    }
+}
+
+/**
+* Changes the capacity of @param buffer to @param new_capacity entries, between 1 and
+* AESDCHAR_MAX_CAPACITY, dropping the oldest entries past it.  Their buffptr values are still
+* in the buffer's old slots (the first count - new_capacity by AESD_CIRCULAR_BUFFER_FOREACH
+* beforehand) for deallocation by the caller.  @param new_entry is an array of
+* aesd_circular_buffer_slots_for(new_capacity) entries allocated by the caller, or NULL to use
+* the storage in the buffer itself, which only holds AESDCHAR_DEFAULT_SLOTS.  Unless it's the
+* array the buffer already uses, it must have been filled by
+* aesd_circular_buffer_prepare_resize().  Only updates indices and pointers, O(1).
+* Any necessary locking must be handled by the caller
+* Return NULL or, if the buffer was using an array allocated by the caller which it no longer
+* uses, that array (for deallocation by the caller)
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *new_entry, uint32_t new_capacity)
+{
+    struct aesd_buffer_entry *old_entry = buffer->entry;
+    uint32_t new_mask, dropped;
+
+    if (!new_entry) {
+	new_entry = buffer->default_entry;
+	new_mask = AESDCHAR_DEFAULT_SLOTS - 1;
+    } else {
+	new_mask = aesd_circular_buffer_slots_for(new_capacity) - 1;
+    }
+
+    dropped = (buffer->count > new_capacity) ? buffer->count - new_capacity : 0;
+    if (dropped) {
+	buffer->count -= dropped;
+	buffer->out_offs = (buffer->out_offs + dropped) & buffer->mask;
+	buffer->base_offset = buffer->count ?
+	    buffer->entry[buffer->out_offs].abs_offset : buffer->end_offset;
+    }
+
+    // Staying in the same array only changes where the ring fills up
+    if (new_entry != old_entry) {
+	buffer->entry = new_entry;
+	buffer->mask = new_mask;
+	buffer->out_offs = 0;
+	buffer->in_offs = buffer->count & new_mask;
+    }
+    buffer->capacity = new_capacity;
+
+    if ((old_entry == new_entry) || (old_entry == buffer->default_entry)) {
+	return NULL;
+    }
+    return old_entry;
 }
 
 /*
- * Returns total number of bytes in buffer.
+ * Returns total number of bytes in buffer, kept up to date as entries come
+ * and go.
  * Any necessary locking must be performed by caller.
  */
 loff_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer)
 {
-    struct aesd_buffer_entry *entry;
-    uint8_t index;
-    loff_t retval = 0;
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,buffer,index) {
-	if (entry->buffptr) {
-	    retval += entry->size;
-	}
-    }
-    return retval;
+    return buffer->end_offset - buffer->base_offset;
 }
@@ -16,7 +16,17 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Default capacity of the buffer, in entries.  The ring is allocated at the
+ * next power of two so indices wrap with a mask, see
+ * aesd_circular_buffer_slots_for().
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+#define AESDCHAR_DEFAULT_SLOTS 16
+/**
+ * Largest capacity aesd_circular_buffer_resize() accepts
+ */
+#define AESDCHAR_MAX_CAPACITY (1U << 24)
 
 struct aesd_buffer_entry
 {
@@ -28,27 +38,60 @@ struct aesd_buffer_entry
      * Number of bytes stored in buffptr
      */
     size_t size;
+    /**
+     * Position of the first byte of this entry in everything ever added to the
+     * buffer, set by aesd_circular_buffer_add_entry()
+     */
+    uint64_t abs_offset;
 };
 
 struct aesd_circular_buffer
 {
     /**
-     * An array of pointers to memory allocated for the most recent write operations
+     * An array of pointers to memory allocated for the most recent write operations.
+     * Points at default_entry after aesd_circular_buffer_init(), or at an array
+     * installed by aesd_circular_buffer_resize().  Has mask + 1 slots.
+     */
+    struct aesd_buffer_entry *entry;
+    /**
+     * Number of slots in entry minus one.  The slot count is a power of two.
+     */
+    uint32_t mask;
+    /**
+     * Maximum number of entries held before the oldest is overwritten, at most
+     * mask + 1
+     */
+    uint32_t capacity;
+    /**
+     * Number of entries currently held.  Full when it reaches capacity.
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    uint32_t count;
     /**
      * The current location in the entry structure where the next write should
      * be stored.
      */
-    uint8_t in_offs;
+    uint32_t in_offs;
     /**
      * The first location in the entry structure to read from
      */
-    uint8_t out_offs;
+    uint32_t out_offs;
     /**
-     * set to true when the buffer entry structure is full
+     * abs_offset of the oldest entry held, or of the next entry if empty.  Char offset 0.
      */
-    bool full;
+    uint64_t base_offset;
+    /**
+     * abs_offset of the next entry to be added.  end_offset - base_offset is the size.
+     */
+    uint64_t end_offset;
+    /**
+     * Limit on the bytes held, 0 for none, see aesd_circular_buffer_make_room()
+     */
+    uint64_t max_bytes;
+    /**
+     * Storage for the default capacity, so a buffer on the stack or in a static
+     * needs no allocation
+     */
+    struct aesd_buffer_entry default_entry[AESDCHAR_DEFAULT_SLOTS];
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
@@ -60,14 +103,29 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
 extern loff_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
 
+extern const char *aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer);
+
+extern const char *aesd_circular_buffer_make_room(struct aesd_circular_buffer *buffer, size_t size);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_find_fpos_for_entry(struct aesd_circular_buffer *buffer,
+            uint32_t entry_index, loff_t *fpos_rtn);
+
+extern uint32_t aesd_circular_buffer_slots_for(uint32_t capacity);
+
+extern void aesd_circular_buffer_prepare_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *new_entry, uint32_t new_capacity);
+
+extern struct aesd_buffer_entry *aesd_circular_buffer_resize(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *new_entry, uint32_t new_capacity);
+
 /**
- * Create a for loop to iterate over each member of the circular buffer.
+ * Create a for loop to iterate over each entry in the circular buffer, oldest first.
  * Useful when you've allocated memory for circular buffer entries and need to free it
  * @param entryptr is a struct aesd_buffer_entry* to set with the current entry
  * @param buffer is the struct aesd_buffer * describing the buffer
- * @param index is a uint8_t stack allocated value used by this macro for an index
+ * @param index is a uint32_t stack allocated value used by this macro for an index
  * Example usage:
- * uint8_t index;
+ * uint32_t index;
  * struct aesd_circular_buffer buffer;
  * struct aesd_buffer_entry *entry;
  * AESD_CIRCULAR_BUFFER_FOREACH(entry,&buffer,index) {
@@ -75,9 +133,9 @@ extern loff_t aesd_circular_buffer_size(struct aesd_circular_buffer *buffer);
  * }
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
-    for(index=0, entryptr=&((buffer)->entry[((buffer)->out_offs+index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
-            index++, entryptr=&((buffer)->entry[((buffer)->out_offs+index) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED]))
+    for(index=0, entryptr=&((buffer)->entry[((buffer)->out_offs+index) & (buffer)->mask]); \
+            index<(buffer)->count; \
+            index++, entryptr=&((buffer)->entry[((buffer)->out_offs+index) & (buffer)->mask]))
 
 
 
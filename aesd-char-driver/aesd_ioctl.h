@@ -33,14 +33,57 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * Where the device contents are in its mmap()ed ring, see AESDCHAR_IOCGWINDOW
+ */
+struct aesd_window {
+    /**
+     * Offset of the oldest byte held, counting every byte ever written
+     */
+    uint64_t base;
+    /**
+     * Offset just past the newest byte held
+     */
+    uint64_t end;
+    /**
+     * Bytes in the ring, 0 if the device hasn't been mapped since max_bytes
+     * last changed
+     */
+    uint64_t map_size;
+};
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Get and set the number of writes the device holds.  Shrinking drops the
+// oldest writes.  Up to AESDCHAR_MAX_CAPACITY, see aesd-circular-buffer.h
+#define AESDCHAR_IOCGCAPACITY _IOR(AESD_IOC_MAGIC, 2, uint32_t)
+#define AESDCHAR_IOCSCAPACITY _IOW(AESD_IOC_MAGIC, 3, uint32_t)
+// Get and set the limit on the bytes the device holds, 0 for none.  The
+// oldest writes are dropped to stay under it, and a write that can't fit
+// at all fails with EFBIG.
+#define AESDCHAR_IOCGMAXBYTES _IOR(AESD_IOC_MAGIC, 4, uint64_t)
+#define AESDCHAR_IOCSMAXBYTES _IOW(AESD_IOC_MAGIC, 5, uint64_t)
+// With a byte limit, the device can be mmap()ed read-only, up to twice
+// map_size bytes from offset 0.  The ring is mapped twice in a row, so the
+// end - base bytes held are contiguous starting (base % map_size) bytes in.
+// New writes overwrite the oldest bytes; bytes read at offset x are good if
+// base is still <= x when the window is fetched again afterward.  map_size
+// changes (remap) when max_bytes does.
+#define AESDCHAR_IOCGWINDOW _IOR(AESD_IOC_MAGIC, 6, struct aesd_window)
+// Nonzero turns on follow mode for this open file (tail -f): reads go on
+// from the current position as writes come in, and at the end wait for
+// the next one (or fail with EAGAIN if O_NONBLOCK) instead of returning 0.
+// 0 turns it off.
+#define AESDCHAR_IOCSFOLLOW _IOW(AESD_IOC_MAGIC, 7, uint32_t)
+// Get the bytes dropped by the device before this file, in follow mode,
+// could read them.  Reads skip ahead to the oldest byte held.
+#define AESDCHAR_IOCGOVERRUN _IOR(AESD_IOC_MAGIC, 8, uint64_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 8
 
 #endif /* AESD_IOCTL_H */
@@ -26,7 +26,19 @@
 // Need definitions of struct aesd_buffer_entry and struct aesd_circular_buffer
 #include "aesd-circular-buffer.h"
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/srcu.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/wait.h>
 
+// Readers don't take lock.  They walk circ_buf inside an SRCU read side
+// section, retrying if seq shows a writer changed it meanwhile, and copy
+// out of entry buffers that are only freed once no reader can be using
+// them (see aesd_buf_retire()).  Swapping the ring array for another
+// (resize) is rare and waits for readers through resize_sem instead,
+// which they only hold while finding an entry, never while copying out.
+// Lock order: lock, then mmap_lock (faults), then mirror_lock, then
+// resize_sem.
 struct aesd_dev
 {
     /**
@@ -35,9 +47,33 @@ struct aesd_dev
     // cdev @ start - single inheritance, p_cdev = p_aesd_dev
     struct aesd_circular_buffer circ_buf;
     struct aesd_buffer_entry partial_write;
-    struct mutex lock;
+    size_t partial_alloc;	// Bytes allocated at partial_write.buffptr
+    struct page *frag_page;	// Page new small entry buffers go in, or NULL
+    size_t frag_offset;		// Bytes of frag_page used
+    struct mutex lock;		// Held by writers
+    seqcount_mutex_t seq;	// Bumped by writers changing circ_buf
+    struct srcu_struct srcu;	// Readers of entry buffers
+    struct percpu_rw_semaphore resize_sem; // Readers of circ_buf.entry
+    struct mutex mirror_lock;	// Held adding/dropping entries or changing mirror
+    char *mirror;		// History ring for aesd_mmap(), NULL until mapped
+    size_t mirror_size;		// Bytes at mirror, a power of two
+    wait_queue_head_t wait;	// Woken when a write completes a command
     struct cdev cdev;     /* Char device structure      */
 };
 
+// Per open file, at filp->private_data.  aesd_poll() and the ioctls look
+// at these without any lock, so they're accessed with READ_ONCE() and
+// WRITE_ONCE().
+struct aesd_file
+{
+    struct aesd_dev *dev;
+    bool follow;		// Reads wait for new writes at the end, see
+				// AESDCHAR_IOCSFOLLOW
+    uint64_t next;		// Stream offset of the file position as of the
+				// last read, write or seek, where a follower
+				// goes on
+    uint64_t overrun;		// Bytes dropped before a follower read them
+};
+
 
 #endif /* AESD_CHAR_DRIVER_AESDCHAR_H_ */
@@ -18,28 +18,208 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h> // kmalloc/free
+#include <linux/mm.h> // kvcalloc/kvfree
+#include <linux/moduleparam.h>
+#include <linux/uio.h> // iov_iter
+#include <linux/version.h>
+#include <linux/vmalloc.h> // vmalloc_user/vfree
+#include <linux/log2.h> // roundup_pow_of_two
+#include <linux/poll.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
+// Number of writes the device holds, changed at runtime with
+// AESDCHAR_IOCSCAPACITY
+static uint ring_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(ring_entries, uint, 0444);
+MODULE_PARM_DESC(ring_entries, "Number of writes held (default 10)");
+
+// Limit on the bytes the device holds, 0 for none, changed at runtime
+// with AESDCHAR_IOCSMAXBYTES
+static ulong max_bytes = 0;
+module_param(max_bytes, ulong, 0444);
+MODULE_PARM_DESC(max_bytes, "Limit on bytes held, 0 for none (default 0)");
+
 MODULE_AUTHOR("Thomas Ames"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct aesd_dev aesd_device;
 
+// Every entry buffer is allocated behind one of these, so an entry
+// dropped from the ring can be freed once the last reader that might
+// still be copying from it is done.  Entry buffers are never changed once
+// they're in the ring.
+//
+// They live in pages rather than slab objects, so aesd_splice_read() can
+// hand them to a pipe by reference (sockets refuse slab pages).  Buffers
+// up to a page are carved one after another out of dev->frag_page, each
+// holding a reference on it, bigger ones are vmalloc()ed.  Either way a
+// pipe holding a page keeps it after the entry is freed.
+struct aesd_buf_hdr
+{
+    struct rcu_head rcu;
+    char data[];
+};
+
+// Allocate an entry buffer of size bytes for dev.  Must be called with the
+// lock held.  Returns NULL if out of memory.
+static char *aesd_buf_alloc(struct aesd_dev *dev, size_t size)
+{
+    struct aesd_buf_hdr *hdr;
+    size_t frag_size = ALIGN(sizeof(*hdr) + size, sizeof(long));
+
+    if (frag_size > PAGE_SIZE) {
+	hdr = vmalloc(sizeof(*hdr) + size);
+	return hdr ? hdr->data : NULL;
+    }
+    if (dev->frag_page && (dev->frag_offset + frag_size > PAGE_SIZE)) {
+	put_page(dev->frag_page);
+	dev->frag_page = NULL;
+    }
+    if (!dev->frag_page) {
+	if (!(dev->frag_page = alloc_page(GFP_KERNEL))) {
+	    return NULL;
+	}
+	dev->frag_offset = 0;
+    }
+    hdr = page_address(dev->frag_page) + dev->frag_offset;
+    dev->frag_offset += frag_size;
+    get_page(dev->frag_page);
+    return hdr->data;
+}
+
+static void aesd_buf_put(struct aesd_buf_hdr *hdr)
+{
+    if (is_vmalloc_addr(hdr)) {
+	vfree(hdr);
+    } else {
+	put_page(virt_to_page(hdr));
+    }
+}
+
+// Free an entry buffer no reader can be using, because it was never in
+// the ring or there are no readers left.  buf may be NULL.
+static void aesd_buf_free(const char *buf)
+{
+    if (buf) {
+	aesd_buf_put(container_of((void *) buf, struct aesd_buf_hdr, data));
+    }
+}
+
+static void aesd_buf_free_rcu(struct rcu_head *rcu)
+{
+    aesd_buf_put(container_of(rcu, struct aesd_buf_hdr, rcu));
+}
+
+// The page holding the entry buffer byte at p
+static struct page *aesd_buf_page(const char *p)
+{
+    return is_vmalloc_addr(p) ? vmalloc_to_page(p) : virt_to_page(p);
+}
+
+// Free an entry buffer dropped from the ring of dev once the readers
+// that might be copying from it are done.  buf may be NULL.  Safe in a
+// seqcount write section.
+static void aesd_buf_retire(struct aesd_dev *dev, const char *buf)
+{
+    struct aesd_buf_hdr *hdr;
+
+    if (buf) {
+	hdr = container_of((void *) buf, struct aesd_buf_hdr, data);
+	call_srcu(&dev->srcu, &hdr->rcu, aesd_buf_free_rcu);
+    }
+}
+
+// Bytes in the mirror for a limit of max_bytes, 0 if it can't have one.
+// A power of two, so stream offsets map into it with a mask.
+static size_t aesd_mirror_size_for(uint64_t max_bytes)
+{
+    if ((!max_bytes) || (max_bytes > ULONG_MAX / 2 + 1)) {
+	return 0;
+    }
+    return roundup_pow_of_two(max_t(uint64_t, max_bytes, PAGE_SIZE));
+}
+
+// Copy size bytes at buf into the mirror of dev, for stream offset
+// abs_offset.  Must be called with the mirror_lock held.
+static void aesd_mirror_copy(struct aesd_dev *dev, uint64_t abs_offset,
+			     const char *buf, size_t size)
+{
+    size_t start = abs_offset & (dev->mirror_size - 1);
+    size_t first = min(size, dev->mirror_size - start);
+
+    memcpy(dev->mirror + start, buf, first);
+    // Wraps to the start of the ring
+    memcpy(dev->mirror, buf + first, size - first);
+}
+
+/*
+ * Give @param dev a mirror, holding the writes already in the circular buffer,
+ * if it doesn't have one.  Must be called with the mirror_lock held.
+ * @return 0 if successful, negative if error occurred:
+ *   -ENODEV if there's no byte limit to size it by
+ *   -ENOMEM if it could not be allocated
+ */
+static int aesd_mirror_alloc(struct aesd_dev *dev)
+{
+    struct aesd_buffer_entry *entry;
+    uint32_t index;
+    size_t size;
+
+    if (dev->mirror) {
+	return 0;
+    }
+    if (!dev->circ_buf.max_bytes) {
+	return -ENODEV;
+    }
+    if ((!(size = aesd_mirror_size_for(dev->circ_buf.max_bytes))) ||
+	(!(dev->mirror = vmalloc_user(size)))) {
+	return -ENOMEM;
+    }
+    dev->mirror_size = size;
+    // mirror_lock keeps out writers adding and dropping entries, except
+    // aesd_set_capacity(), which resize_sem does
+    percpu_down_read(&dev->resize_sem);
+    AESD_CIRCULAR_BUFFER_FOREACH(entry,&dev->circ_buf,index) {
+	aesd_mirror_copy(dev, entry->abs_offset, entry->buffptr, entry->size);
+    }
+    percpu_up_read(&dev->resize_sem);
+    PDEBUG("mirror of %zu bytes", size);
+    return 0;
+}
+
+// Drop the mirror of dev.  Pages still mapped stay around until unmapped,
+// but stop changing.  Must be called with the mirror_lock held.
+static void aesd_mirror_free(struct aesd_dev *dev)
+{
+    // vfree(NULL) is a nop
+    vfree(dev->mirror);
+    dev->mirror = NULL;
+    dev->mirror_size = 0;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
     PDEBUG("open");
     /**
      * TODO: handle open
      */
+    struct aesd_file *p_file;
 
+    // Each open file has its own follow mode state
+    if (!(p_file = kzalloc(sizeof(*p_file), GFP_KERNEL))) {
+	return -ENOMEM;
+    }
     // Use container_of macro to get pointer to the cdev.  First field
     // of aesd_dev is cdev, so p_cdev == p_aesd_dev
-    filp->private_data = container_of(inode->i_cdev, struct aesd_dev, cdev);
-    PDEBUG("filp->private_data = %p, inode->i_cdev = %p, &aesd_device = %p",
-	   filp->private_data, inode->i_cdev, &aesd_device);
+    p_file->dev = container_of(inode->i_cdev, struct aesd_dev, cdev);
+    filp->private_data = p_file;
+    PDEBUG("p_file->dev = %p, inode->i_cdev = %p, &aesd_device = %p",
+	   p_file->dev, inode->i_cdev, &aesd_device);
     return 0;
 }
 
@@ -49,90 +229,323 @@ int aesd_release(struct inode *inode, struct file *filp)
     /**
      * TODO: handle release
      */
-    // Nothing to do - release is the opposite of open, but we don't
-    // do anything in open that needs to be undone.
+    kfree(filp->private_data);
     return 0;
 }
 
 loff_t aesd_llseek(struct file *filp, loff_t offset, int whence)
 {
-    struct aesd_dev *p_aesd_dev = (struct aesd_dev *) filp->private_data;
+    struct aesd_file *p_file = (struct aesd_file *) filp->private_data;
+    struct aesd_dev *p_aesd_dev = p_file->dev;
     loff_t size = 0;
     loff_t retval = -EINVAL;
+    uint64_t base;
+    unsigned int seq;
 
     PDEBUG("aesd_llseek: offset = %lld, whence = %d", offset, whence);
-    // Returns 0 if lock aquired, -EINTR if interrupted. Probably don't
-    // need to lock the ENTIRE function body.
-    if (mutex_lock_interruptible(&aesd_device.lock)) {
-	return -EINTR;
-    }
-    size = aesd_circular_buffer_size(&(p_aesd_dev->circ_buf));
+    // The size is two offsets, read them both from the same version
+    do {
+	seq = read_seqcount_begin(&p_aesd_dev->seq);
+	base = p_aesd_dev->circ_buf.base_offset;
+	size = aesd_circular_buffer_size(&(p_aesd_dev->circ_buf));
+    } while (read_seqcount_retry(&p_aesd_dev->seq, seq));
     retval = fixed_size_llseek(filp, offset, whence, size);
-    mutex_unlock(&aesd_device.lock);
+    if (retval >= 0) {
+	WRITE_ONCE(p_file->next, base + retval);
+    }
 
     PDEBUG("aesd_llseek: size = %lld",size);
     return retval;
 }
 
-ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
-                loff_t *f_pos)
+// Stream offset just past the newest byte held by dev, without the lock
+static uint64_t aesd_end_offset(struct aesd_dev *dev)
+{
+    uint64_t end_offset;
+    unsigned int seq;
+
+    // 64 bits may take two loads
+    do {
+	seq = read_seqcount_begin(&dev->seq);
+	end_offset = dev->circ_buf.end_offset;
+    } while (read_seqcount_retry(&dev->seq, seq));
+    return end_offset;
+}
+
+/*
+ * Wait for @param dev to hold bytes past stream offset @param next, where a
+ * follower goes on.
+ * @return 0 once it does, or negative if error occurred:
+ *   -EAGAIN if @param nonblock
+ *   -ERESTARTSYS if interrupted
+ */
+static int aesd_follow_wait(struct aesd_dev *dev, uint64_t next, bool nonblock)
+{
+    if (aesd_end_offset(dev) != next) {
+	return 0;
+    }
+    if (nonblock) {
+	return -EAGAIN;
+    }
+    if (wait_event_interruptible(dev->wait, aesd_end_offset(dev) != next)) {
+	return -ERESTARTSYS;
+    }
+    return 0;
+}
+
+/*
+ * Find the bytes @param dev holds at file position *@param p_pos, or for a
+ * follower at stream offset *@param p_next, skipping whatever went before
+ * it was read (added to *@param p_overrun).  Sets *@param p_pos and
+ * *@param p_next to where the bytes found are, and *@param p_avail to how
+ * many there are up to the end of their entry.  Must be called in an SRCU
+ * read side section, which keeps the entry buffer found allocated.
+ * @return the bytes, or NULL at the end of the data
+ */
+static const char *aesd_find_pos(struct aesd_dev *dev, bool follow,
+				 loff_t *p_pos, uint64_t *p_next,
+				 uint64_t *p_overrun, size_t *p_avail)
 {
-    // Probably safe to assume the kernel doesn't pass a null filp
-    struct aesd_dev *p_aesd_dev = (struct aesd_dev *) filp->private_data;
     struct aesd_buffer_entry *p_cir_buf_entry;
     size_t cir_buf_entry_offset;
-    const void * from_buf;
-    size_t avail_bytes_in_buf, bytes_to_copy;
+    const char *from_buf = NULL;
+    uint64_t base, skipped = 0;
+    unsigned int seq;
+    loff_t pos;
+
+    // Find the entry again if a writer changed the ring under us
+    percpu_down_read(&dev->resize_sem);
+    do {
+	seq = read_seqcount_begin(&dev->seq);
+	base = dev->circ_buf.base_offset;
+	pos = *p_pos;
+	if (follow) {
+	    // Positions move as old writes go, a follower tracks the
+	    // stream offset instead.  Skip what went before it was read.
+	    skipped = (*p_next < base) ? base - *p_next : 0;
+	    pos = *p_next + skipped - base;
+	}
+	p_cir_buf_entry =
+	    aesd_circular_buffer_find_entry_offset_for_fpos(&(dev->circ_buf),
+							    pos,
+							    &cir_buf_entry_offset);
+	// p_cir_buf_entry->buffptr is the START of the buffer.  Desired
+	// data starts at p_cir_buf_entry->buffptr + cir_buf_entry_offset,
+	// available bytes is p_cir_buf_entry->size - cir_buf_entry_offset.
+	if (p_cir_buf_entry) {
+	    from_buf = p_cir_buf_entry->buffptr + cir_buf_entry_offset;
+	    *p_avail = p_cir_buf_entry->size - cir_buf_entry_offset;
+	}
+    } while (read_seqcount_retry(&dev->seq, seq));
+    percpu_up_read(&dev->resize_sem);
+    *p_pos = pos;
+    *p_next = base + pos;
+    *p_overrun += skipped;
+    return p_cir_buf_entry ? from_buf : NULL;
+}
+
+/*
+ * Copy the device contents starting @param iocb->ki_pos bytes in to @param to,
+ * across as many writes as fit, so one read() (or readv()) can return the
+ * whole history.  Advances iocb->ki_pos past the bytes copied.  In follow
+ * mode, reads go on from the last byte read instead, waiting at the end.
+ * @return bytes copied, 0 at end of data, or negative if error occurred:
+ *   -EFAULT if nothing could be copied to the caller's buffer
+ *   -EAGAIN if following, at the end, and O_NONBLOCK
+ *   -ERESTARTSYS if interrupted while following at the end
+ */
+static ssize_t aesd_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    // Probably safe to assume the kernel doesn't pass a null filp
+    struct aesd_file *p_file = (struct aesd_file *) iocb->ki_filp->private_data;
+    struct aesd_dev *p_aesd_dev = p_file->dev;
+    const char *from_buf;
+    size_t avail_bytes_in_buf = 0, bytes_to_copy, bytes_copied;
     ssize_t retval = 0;
+    int srcu_idx;
+    loff_t pos;
+    bool follow = READ_ONCE(p_file->follow);
+    uint64_t next = READ_ONCE(p_file->next), overrun = 0;
 
-    PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
+    PDEBUG("read %zu bytes with offset %lld",iov_iter_count(to),iocb->ki_pos);
     /**
      * TODO: handle read
      */
-    // Returns 0 if lock aquired, -EINTR if interrupted. Probably don't
-    // need to lock the ENTIRE function body.
-    if (mutex_lock_interruptible(&aesd_device.lock)) {
-	return -EINTR;
+    if (follow && iov_iter_count(to) &&
+	(retval = aesd_follow_wait(p_aesd_dev, next,
+				   iocb->ki_filp->f_flags & O_NONBLOCK))) {
+	return retval;
     }
+    // No lock, so readers don't wait for each other or for writers.
+    // The ring array stays put while resize_sem is held, and the entry
+    // buffers found stay allocated until srcu_read_unlock(), even if a
+    // writer drops them meanwhile.  resize_sem is only held to find the
+    // entry, not while copying to the caller, which may fault and take
+    // mmap_lock (held by aesd_mmap() callers).
+    srcu_idx = srcu_read_lock(&p_aesd_dev->srcu);
 
-    p_cir_buf_entry =
-	aesd_circular_buffer_find_entry_offset_for_fpos(&(p_aesd_dev->circ_buf),
-							*f_pos,
-							&cir_buf_entry_offset);
-    // If NULL, gone past end of circular buffer, no more data to read.
-    // Return 0 to indicate EOF.  Remove reset f_pos to 0 now that we
-    // have llseek() support.
-    if (!p_cir_buf_entry) {
-	mutex_unlock(&aesd_device.lock);
-	PDEBUG("read at EOF, retval 0");
-	return 0;
+    while (iov_iter_count(to)) {
+	pos = iocb->ki_pos;
+	from_buf = aesd_find_pos(p_aesd_dev, follow, &pos, &next, &overrun,
+				 &avail_bytes_in_buf);
+	// If NULL, gone past end of circular buffer, no more data to read.
+	// Return what was copied so far, 0 indicates EOF.
+	if (!from_buf) {
+	    break;
+	}
+
+	bytes_to_copy = min(avail_bytes_in_buf, iov_iter_count(to));
+	bytes_copied = copy_to_iter(from_buf, bytes_to_copy, to);
+	iocb->ki_pos = pos + bytes_copied;
+	next += bytes_copied;
+	retval += bytes_copied;
+	if (bytes_copied != bytes_to_copy) {
+	    // Bad user buffer.  Only an error if nothing made it.
+	    if (!retval) {
+		retval = -EFAULT;
+	    }
+	    break;
+	}
+    }
+    PDEBUG("read update offset to %lld, retval %ld",iocb->ki_pos,retval);
+    // For aesd_poll(), and where a follower goes on
+    WRITE_ONCE(p_file->next, next);
+    if (overrun) {
+	WRITE_ONCE(p_file->overrun, READ_ONCE(p_file->overrun) + overrun);
     }
 
-    // p_cir_buf_entry holds a valid pointer to a buffer entry.
-    // p_cir_buf_entry->buffptr is the START of the buffer.  Desired
-    // data starts at p_cir_buf_entry->buffptr + cir_buf_entry_offset,
-    // available bytes is p_cir_buf_entry->size - cir_buf_entry_offset.
-    from_buf = p_cir_buf_entry->buffptr + cir_buf_entry_offset;
-    avail_bytes_in_buf = p_cir_buf_entry->size - cir_buf_entry_offset;
-    bytes_to_copy = min(avail_bytes_in_buf, count);
+    srcu_read_unlock(&p_aesd_dev->srcu, srcu_idx);
+    return retval;
+}
 
-    // bytes_to_copy returns number NOT copied, 0 on success.
-    // subtract # failed from number desired to get # copied
-    retval = bytes_to_copy - copy_to_user(buf, from_buf, bytes_to_copy);
-    *f_pos += retval;
-    PDEBUG("read update offset to %lld, retval %ld",*f_pos,retval);
-    mutex_unlock(&aesd_device.lock);
+/*
+ * Splice up to @param len bytes of the device contents starting *@param ppos
+ * bytes in to @param pipe, like aesd_read_iter() (following too), but
+ * without copying them: each pipe buffer takes a reference on the page of
+ * an entry buffer (see aesd_buf_alloc()).  Entry buffers never change, so
+ * the pipe holds a snapshot even once the entries are dropped.  Advances
+ * *@param ppos past the bytes spliced.
+ * @return bytes spliced, 0 at end of data, or negative if error occurred:
+ *   -EAGAIN if following, at the end, and nonblocking, or the pipe is full
+ *   -ERESTARTSYS if interrupted while following at the end
+ *   -EPIPE if the pipe has no readers
+ */
+static ssize_t aesd_splice_read(struct file *in, loff_t *ppos,
+				struct pipe_inode_info *pipe, size_t len,
+				unsigned int flags)
+{
+    struct aesd_file *p_file = (struct aesd_file *) in->private_data;
+    struct aesd_dev *p_aesd_dev = p_file->dev;
+    struct pipe_buffer buf;
+    const char *from_buf;
+    size_t avail_bytes_in_buf = 0, bytes_to_splice;
+    ssize_t retval = 0, added;
+    int srcu_idx;
+    loff_t pos;
+    bool follow = READ_ONCE(p_file->follow);
+    uint64_t next = READ_ONCE(p_file->next), overrun = 0;
+
+    PDEBUG("splice %zu bytes with offset %lld", len, *ppos);
+    if (follow && len &&
+	(retval = aesd_follow_wait(p_aesd_dev, next,
+				   (in->f_flags & O_NONBLOCK) ||
+				   (flags & SPLICE_F_NONBLOCK)))) {
+	return retval;
+    }
+    // Lockless like aesd_read_iter().  The entry buffers found hold their
+    // pages until srcu_read_unlock(), by which time the pipe has its own
+    // references.
+    srcu_idx = srcu_read_lock(&p_aesd_dev->srcu);
+
+    while (len) {
+	pos = *ppos;
+	from_buf = aesd_find_pos(p_aesd_dev, follow, &pos, &next, &overrun,
+				 &avail_bytes_in_buf);
+	if (!from_buf) {
+	    break;
+	}
+
+	// A pipe buffer can't cross into the next page
+	bytes_to_splice = min3(avail_bytes_in_buf, len,
+			       PAGE_SIZE - offset_in_page(from_buf));
+	buf = (struct pipe_buffer) {
+	    .page = aesd_buf_page(from_buf),
+	    .offset = offset_in_page(from_buf),
+	    .len = bytes_to_splice,
+	    .ops = &nosteal_pipe_buf_ops,
+	};
+	get_page(buf.page);
+	// Drops the reference itself if the pipe is full or has no readers
+	if ((added = add_to_pipe(pipe, &buf)) < 0) {
+	    if (!retval) {
+		retval = added;
+	    }
+	    break;
+	}
+	*ppos = pos + bytes_to_splice;
+	next += bytes_to_splice;
+	len -= bytes_to_splice;
+	retval += bytes_to_splice;
+    }
+    PDEBUG("splice update offset to %lld, retval %ld", *ppos, retval);
+    WRITE_ONCE(p_file->next, next);
+    if (overrun) {
+	WRITE_ONCE(p_file->overrun, READ_ONCE(p_file->overrun) + overrun);
+    }
+
+    srcu_read_unlock(&p_aesd_dev->srcu, srcu_idx);
     return retval;
 }
 
+/*
+ * Add @param entry to the circular buffer of @param dev, and its mirror if
+ * any, freeing every older entry it displaces, by count or by bytes.  Must
+ * be called with the lock held.
+ */
+static void aesd_add_entry(struct aesd_dev *dev,
+			   const struct aesd_buffer_entry *entry)
+{
+    const char *evicted;
+
+    mutex_lock(&dev->mirror_lock);
+    write_seqcount_begin(&dev->seq);
+    while ((evicted = aesd_circular_buffer_make_room(&(dev->circ_buf),
+						     entry->size))) {
+	aesd_buf_retire(dev, evicted);
+    }
+    write_seqcount_end(&dev->seq);
+
+    // The bytes overwritten in the mirror were dropped above, so mappers
+    // see base move past them first
+    if (dev->mirror) {
+	aesd_mirror_copy(dev, dev->circ_buf.end_offset, entry->buffptr,
+			 entry->size);
+    }
+
+    write_seqcount_begin(&dev->seq);
+    // Nothing left to overwrite after make_room, but free it if so
+    aesd_buf_retire(dev, aesd_circular_buffer_add_entry(&(dev->circ_buf),
+							entry));
+    write_seqcount_end(&dev->seq);
+    mutex_unlock(&dev->mirror_lock);
+    wake_up_interruptible(&dev->wait);
+    PDEBUG("write: added entry of %zu bytes", entry->size);
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     // Probably safe to assume the kernel doesn't pass a null filp
-    struct aesd_dev *p_aesd_dev = (struct aesd_dev *) filp->private_data;
+    struct aesd_file *p_file = (struct aesd_file *) filp->private_data;
+    struct aesd_dev *p_aesd_dev = p_file->dev;
     void * kmem_buf;
-    const char * add_entry_retval;
+    char *entry_buf;
+    const char *start, *end, *newline;
+    struct aesd_buffer_entry entry;
+    size_t new_size, new_alloc;
+    uint64_t limit;
     ssize_t retval = -ENOMEM;
+    int err = 0;
 
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
     /**
@@ -145,40 +558,32 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 	return -EINTR;
     }
 
-    // Partial write in progress?
-    if (p_aesd_dev->partial_write.buffptr) {
-	// Partial write in progress, expand current buffer by count
-	if (!(kmem_buf = kmalloc(count + p_aesd_dev->partial_write.size,
-				 GFP_KERNEL))) {
-	    printk("write: kmalloc(%ld, GFP_KERNEL) returned NULL", count);
-	    mutex_unlock(&aesd_device.lock);
-	    return -ENOMEM;
-	} else {
-	    // Copy the previous partial write to the new, larger buffer
-	    memcpy(kmem_buf, p_aesd_dev->partial_write.buffptr,
-		   p_aesd_dev->partial_write.size);
-	    // Deallocate old buffer, save new.
-	    kfree(p_aesd_dev->partial_write.buffptr);
-	    p_aesd_dev->partial_write.buffptr = kmem_buf;
-	    // Increment kmem_buf to first byte after previous write
-	    kmem_buf += p_aesd_dev->partial_write.size;
-	}
-    } else {
-	// No previous partial write, but this one may be partial...
-	if (!(kmem_buf = kmalloc(count, GFP_KERNEL))) {
-	    printk("write: kmalloc(%ld, GFP_KERNEL) returned NULL", count);
+    // Grow the partial write buffer to fit count more bytes.  The first
+    // piece of a command gets exactly what it needs, so a command written
+    // in one go costs no more than before.  After that the buffer at least
+    // doubles each time it grows, so a command written in k small pieces
+    // is copied O(1) times per byte by krealloc() rather than O(k).
+    new_size = p_aesd_dev->partial_write.size + count;
+    if (new_size > p_aesd_dev->partial_alloc) {
+	new_alloc = p_aesd_dev->partial_write.buffptr ?
+	    max(new_size, 2 * p_aesd_dev->partial_alloc) : new_size;
+	if (!(kmem_buf = krealloc(p_aesd_dev->partial_write.buffptr,
+				  new_alloc, GFP_KERNEL))) {
+	    printk("write: krealloc(%zu, GFP_KERNEL) returned NULL", new_alloc);
 	    mutex_unlock(&aesd_device.lock);
 	    return -ENOMEM;
-	} else {
-	    p_aesd_dev->partial_write.buffptr = kmem_buf;
-	    p_aesd_dev->partial_write.size = 0;
 	}
+	p_aesd_dev->partial_write.buffptr = kmem_buf;
+	p_aesd_dev->partial_alloc = new_alloc;
     }
+    // First byte after the previous partial write(s), if any
+    kmem_buf = (char *) p_aesd_dev->partial_write.buffptr +
+	p_aesd_dev->partial_write.size;
 
     // At this point, we are either in the middle of a partial write, or
     // assuming we are starting a new partial write.  The following are
     // valid:
-    //   kmem_buf is the pointer in the new buffer to write the data
+    //   kmem_buf is the pointer in the buffer to write the data
     //   p_aesd_dev->partial_write.buffptr holds the address of the first
     //     partial write (possibly this one)
     //   p_aesd_dev->partial_write.size is the size of the prior partial
@@ -186,24 +591,75 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     // Remaining steps:
     //  - Copy from user buf to kmem_buf
     //  - Add count to p_aesd_dev->partial_write.size
-    //  - If newline terminated, add to circular buffer and NULL out
-    //    partial_write
+    //  - Add each newline terminated command to the circular buffer,
+    //    keeping anything after the last newline as partial_write
 
     // copy_from_user returns number of bytes NOT copied, 0 on success
     retval = count - copy_from_user(kmem_buf, buf, count);
-    *f_pos += retval;
     p_aesd_dev->partial_write.size += retval;
 
-    if ('\n' == *((char *)kmem_buf+(retval-1))) {
-	if ((add_entry_retval =
-	     aesd_circular_buffer_add_entry(&(p_aesd_dev->circ_buf),
-					    &(p_aesd_dev->partial_write)))) {
-	    kfree(add_entry_retval);
+    // Only the bytes just copied can hold a newline.  Each complete
+    // command gets an exact copy as its own entry, in page backed storage
+    // (see aesd_buf_alloc()), so seekto indexes them separately, none pins
+    // the memory of the others and they can be spliced.  A command that
+    // could never fit under the byte limit is refused, not allowed to
+    // empty the buffer, as is a partial write that has grown past it.
+    limit = p_aesd_dev->circ_buf.max_bytes;
+    start = p_aesd_dev->partial_write.buffptr;
+    end = start + p_aesd_dev->partial_write.size;
+    newline = memchr(kmem_buf, '\n', retval);
+    while (newline) {
+	entry.size = newline + 1 - start;
+	if (limit && (entry.size > limit)) {
+	    err = -EFBIG;
+	    break;
+	}
+	if (!(entry_buf = aesd_buf_alloc(p_aesd_dev, entry.size))) {
+	    printk("write: aesd_buf_alloc(%zu) returned NULL", entry.size);
+	    err = -ENOMEM;
+	    break;
 	}
+	memcpy(entry_buf, start, entry.size);
+	entry.buffptr = entry_buf;
+	aesd_add_entry(p_aesd_dev, &entry);
+	start = newline + 1;
+	newline = memchr(start, '\n', end - start);
+    }
+    if ((!err) && limit && ((uint64_t) (end - start) > limit)) {
+	err = -EFBIG;
+    }
+
+    if (err) {
+	if (start == p_aesd_dev->partial_write.buffptr) {
+	    // Nothing added, leave the partial write as it was
+	    p_aesd_dev->partial_write.size -= retval;
+	    mutex_unlock(&aesd_device.lock);
+	    return err;
+	}
+	// Only accept the commands already added
+	retval = start - (const char *) kmem_buf;
+	end = start;
+    }
+
+    // Whatever follows the last newline is the new partial write.  A
+    // buffer of up to a page is kept for the next write.
+    if ((start == end) && (p_aesd_dev->partial_alloc > PAGE_SIZE)) {
+	kfree(p_aesd_dev->partial_write.buffptr);
 	p_aesd_dev->partial_write.buffptr = NULL;
 	p_aesd_dev->partial_write.size = 0;
-	PDEBUG("write: add_entry_retval = %p", add_entry_retval);
+	p_aesd_dev->partial_alloc = 0;
+    } else {
+	if (start != p_aesd_dev->partial_write.buffptr) {
+	    memmove((void *) p_aesd_dev->partial_write.buffptr, start,
+		    end - start);
+	}
+	p_aesd_dev->partial_write.size = end - start;
     }
+    *f_pos += retval;
+    // Where a follower goes on, never past the end
+    WRITE_ONCE(p_file->next, p_aesd_dev->circ_buf.base_offset +
+	       min_t(uint64_t, *f_pos,
+		     aesd_circular_buffer_size(&p_aesd_dev->circ_buf)));
     PDEBUG("write: user buf = %p, kmem_buf = %p, retval = %ld", buf,
 	   kmem_buf, retval);
 
@@ -216,7 +672,6 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
  * specified by @param write_cmd (the zero referenced command to locate) and
  * @param write_cmd_offset (the zero referenced offset into the command)
  * @return 0 if successful, negative if error occurred:
- *   -ERESTARTSYS if mutex could not be obtained
  *   -EINVAL if write_cmd or write_cmd_offset was out of range or invalid
  *
  * Static, as it is only intended to be from aesd_unlocked_ioctl, below.
@@ -224,37 +679,32 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd,
 			     uint32_t write_cmd_offset)
 {
-    uint8_t index;
     struct aesd_buffer_entry *entry;
     long retval = -EINVAL;
     loff_t byte_count = 0;
+    size_t entry_size = 0;
+    uint64_t base;
+    unsigned int seq;
 
     PDEBUG("aesd_adjust_file_offset(), write_cmd=%d, write_cmd_offset=%d",
 	   write_cmd, write_cmd_offset);
 
-    if (write_cmd >= AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
-	return -EINVAL;
-    }
+    // Each entry knows where it starts, no need to add up the ones
+    // before it.  NULL if write_cmd is past the writes held.  Lockless
+    // like aesd_read_iter(), only the offset and size are needed.
+    percpu_down_read(&aesd_device.resize_sem);
+    do {
+	seq = read_seqcount_begin(&aesd_device.seq);
+	base = aesd_device.circ_buf.base_offset;
+	entry = aesd_circular_buffer_find_fpos_for_entry(&aesd_device.circ_buf,
+							 write_cmd, &byte_count);
+	entry_size = entry ? entry->size : 0;
+    } while (read_seqcount_retry(&aesd_device.seq, seq));
+    percpu_up_read(&aesd_device.resize_sem);
 
-    // Returns 0 if lock aquired, -EINTR if interrupted. Probably don't
-    // need to lock the ENTIRE function body.
-    if (mutex_lock_interruptible(&aesd_device.lock)) {
-	return -EINTR;
-    }
-
-    AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.circ_buf,index) {
-	// Since we already checked for out of range write_cmd, this will exit
-	if (index == write_cmd) {
-	    break;
-	} else if (entry->buffptr) {
-	    byte_count += entry->size;
-	}
-    }
-
-    // index is now == write_cmd, buffer is 
-    PDEBUG("aesd_adjust_file_offset(), byte_count=%lld, index=%d, entry=%p",
-	   byte_count, index, entry);
-    if ((!(entry->buffptr)) || (write_cmd_offset >= entry->size)) {
+    PDEBUG("aesd_adjust_file_offset(), byte_count=%lld, entry=%p",
+	   byte_count, entry);
+    if ((!entry) || (write_cmd_offset >= entry_size)) {
 	retval = -EINVAL;
     } else {
 	byte_count += write_cmd_offset;
@@ -262,20 +712,106 @@ static long aesd_adjust_file_offset(struct file *filp, uint32_t write_cmd,
 	PDEBUG("aesd_adjust_file_offset(), change filp->f_pos from %lld to %lld",
 	       filp->f_pos, byte_count);
 	filp->f_pos = byte_count;
+	WRITE_ONCE(((struct aesd_file *) filp->private_data)->next,
+		   base + byte_count);
 	retval = 0;
     }
 
-    mutex_unlock(&aesd_device.lock);
     return retval;
 }
 
 /*
- * Handle ioctl's.  Only AESDCHAR_IOCSEEKTO is supported.  @param arg is a user
- * space pointer to a struct aesd_seekto.
+ * Change the number of writes @param dev holds to @param capacity, dropping
+ * the oldest writes if it shrinks.  Capacities that fit in the circular
+ * buffer's own storage use it, larger ones get a kvcalloc'ed array.  Must be
+ * called with the lock held (or before the device is live).
+ * @return 0 if successful, negative if error occurred:
+ *   -EINVAL if capacity is 0 or more than AESDCHAR_MAX_CAPACITY
+ *   -ENOMEM if the new array could not be allocated
+ */
+static long aesd_set_capacity(struct aesd_dev *dev, uint32_t capacity)
+{
+    struct aesd_buffer_entry *new_entry = NULL, *old_entry;
+    uint32_t slots, dropped, index;
+
+    if ((!capacity) || (capacity > AESDCHAR_MAX_CAPACITY)) {
+	return -EINVAL;
+    }
+
+    // Allocate before dropping anything, so a failure changes nothing.
+    // An array of the right size already is kept.
+    slots = aesd_circular_buffer_slots_for(capacity);
+    if (slots > AESDCHAR_DEFAULT_SLOTS) {
+	if (slots == dev->circ_buf.mask + 1) {
+	    new_entry = dev->circ_buf.entry;
+	} else if (!(new_entry = kvcalloc(slots, sizeof(*new_entry),
+					  GFP_KERNEL))) {
+	    return -ENOMEM;
+	}
+    }
+
+    // Readers index the array without the lock, so keep them out until
+    // the entries have moved.  Not under mirror_lock: aesd_mirror_alloc()
+    // keeps this out with resize_sem instead.
+    percpu_down_write(&dev->resize_sem);
+    // With readers out, the seqcount only guards the offsets llseek and
+    // poll read, so the O(n) work happens before the write section, which
+    // runs with preemption off.  Entries dropped can't be found again once
+    // resize_sem is released, and SRCU covers any still being copied.
+    dropped = (dev->circ_buf.count > capacity) ?
+	dev->circ_buf.count - capacity : 0;
+    for (index = 0; index < dropped; index++) {
+	aesd_buf_retire(dev, dev->circ_buf.entry[(dev->circ_buf.out_offs + index) &
+						 dev->circ_buf.mask].buffptr);
+    }
+    aesd_circular_buffer_prepare_resize(&dev->circ_buf, new_entry, capacity);
+    write_seqcount_begin(&dev->seq);
+    old_entry = aesd_circular_buffer_resize(&dev->circ_buf, new_entry, capacity);
+    write_seqcount_end(&dev->seq);
+    percpu_up_write(&dev->resize_sem);
+    // kvfree(NULL) is a nop
+    kvfree(old_entry);
+    PDEBUG("set capacity %u, %u slots", capacity, dev->circ_buf.mask + 1);
+    return 0;
+}
+
+/*
+ * Set the limit on the bytes @param dev holds to @param new_max_bytes, 0 for
+ * none, dropping the oldest writes to get under it.  The mirror is dropped
+ * too if it no longer fits the limit, the next aesd_mmap() makes a new one.
+ * Must be called with the lock held (or before the device is live).
+ */
+static void aesd_set_max_bytes(struct aesd_dev *dev, uint64_t new_max_bytes)
+{
+    const char *evicted;
+
+    mutex_lock(&dev->mirror_lock);
+    write_seqcount_begin(&dev->seq);
+    dev->circ_buf.max_bytes = new_max_bytes;
+    while ((evicted = aesd_circular_buffer_make_room(&dev->circ_buf, 0))) {
+	aesd_buf_retire(dev, evicted);
+    }
+    write_seqcount_end(&dev->seq);
+    if (dev->mirror_size != aesd_mirror_size_for(new_max_bytes)) {
+	aesd_mirror_free(dev);
+    }
+    mutex_unlock(&dev->mirror_lock);
+    PDEBUG("set max_bytes %llu", new_max_bytes);
+}
+
+/*
+ * Handle ioctl's.  For AESDCHAR_IOCSEEKTO, @param arg is a user space pointer
+ * to a struct aesd_seekto.  For AESDCHAR_IOCGCAPACITY and
+ * AESDCHAR_IOCSCAPACITY, it points to a uint32_t number of writes, and for
+ * AESDCHAR_IOCGMAXBYTES and AESDCHAR_IOCSMAXBYTES to a uint64_t byte limit.
+ * For AESDCHAR_IOCGWINDOW, it points to a struct aesd_window, for
+ * AESDCHAR_IOCSFOLLOW to a uint32_t flag and for AESDCHAR_IOCGOVERRUN to a
+ * uint64_t byte count.
  * @return 0 if successful, negative if error occurred:
  *   -ERESTARTSYS if mutex could not be obtained
  *   -EINVAL if write_cmd or write_cmd_offset was out of range or cmd invalid
  *   -EFAULT if memory pointed to by arg cannot be read.
+ *   -ENOMEM if the capacity could not be increased
  */
 long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
@@ -295,6 +831,105 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	}
 	break;
     }
+    case AESDCHAR_IOCGCAPACITY:
+    {
+	uint32_t capacity;
+	if (mutex_lock_interruptible(&aesd_device.lock)) {
+	    return -EINTR;
+	}
+	capacity = aesd_device.circ_buf.capacity;
+	mutex_unlock(&aesd_device.lock);
+	retval = copy_to_user((void __user *)arg, &capacity,
+			      sizeof(capacity)) ? -EFAULT : 0;
+	break;
+    }
+    case AESDCHAR_IOCSCAPACITY:
+    {
+	uint32_t capacity;
+	if (copy_from_user(&capacity, (const void __user *)arg,
+			   sizeof(capacity)) != 0) {
+	    retval = -EFAULT;
+	    break;
+	}
+	if (mutex_lock_interruptible(&aesd_device.lock)) {
+	    return -EINTR;
+	}
+	retval = aesd_set_capacity(&aesd_device, capacity);
+	mutex_unlock(&aesd_device.lock);
+	break;
+    }
+    case AESDCHAR_IOCGMAXBYTES:
+    {
+	uint64_t limit;
+	if (mutex_lock_interruptible(&aesd_device.lock)) {
+	    return -EINTR;
+	}
+	limit = aesd_device.circ_buf.max_bytes;
+	mutex_unlock(&aesd_device.lock);
+	retval = copy_to_user((void __user *)arg, &limit,
+			      sizeof(limit)) ? -EFAULT : 0;
+	break;
+    }
+    case AESDCHAR_IOCSMAXBYTES:
+    {
+	uint64_t limit;
+	if (copy_from_user(&limit, (const void __user *)arg,
+			   sizeof(limit)) != 0) {
+	    retval = -EFAULT;
+	    break;
+	}
+	if (mutex_lock_interruptible(&aesd_device.lock)) {
+	    return -EINTR;
+	}
+	aesd_set_max_bytes(&aesd_device, limit);
+	mutex_unlock(&aesd_device.lock);
+	retval = 0;
+	break;
+    }
+    case AESDCHAR_IOCGWINDOW:
+    {
+	struct aesd_window window;
+	unsigned int seq;
+	if (mutex_lock_interruptible(&aesd_device.mirror_lock)) {
+	    return -EINTR;
+	}
+	// aesd_set_capacity() moves base without mirror_lock
+	do {
+	    seq = read_seqcount_begin(&aesd_device.seq);
+	    window.base = aesd_device.circ_buf.base_offset;
+	    window.end = aesd_device.circ_buf.end_offset;
+	} while (read_seqcount_retry(&aesd_device.seq, seq));
+	window.map_size = aesd_device.mirror_size;
+	mutex_unlock(&aesd_device.mirror_lock);
+	retval = copy_to_user((void __user *)arg, &window,
+			      sizeof(window)) ? -EFAULT : 0;
+	break;
+    }
+    case AESDCHAR_IOCSFOLLOW:
+    {
+	struct aesd_file *p_file = (struct aesd_file *) filp->private_data;
+	uint32_t follow;
+	if (copy_from_user(&follow, (const void __user *)arg,
+			   sizeof(follow)) != 0) {
+	    retval = -EFAULT;
+	    break;
+	}
+	// Follow on from the current position, which is p_file->next.
+	// filp->f_pos may only be used under f_pos_lock, which read, write
+	// and llseek hold but ioctl doesn't; they keep next in step with it.
+	WRITE_ONCE(p_file->overrun, 0);
+	WRITE_ONCE(p_file->follow, follow != 0);
+	retval = 0;
+	break;
+    }
+    case AESDCHAR_IOCGOVERRUN:
+    {
+	struct aesd_file *p_file = (struct aesd_file *) filp->private_data;
+	uint64_t overrun = READ_ONCE(p_file->overrun);
+	retval = copy_to_user((void __user *)arg, &overrun,
+			      sizeof(overrun)) ? -EFAULT : 0;
+	break;
+    }
     default:
 	retval = -EINVAL;
 	break;
@@ -303,12 +938,87 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+/*
+ * Map the device contents read-only, see AESDCHAR_IOCGWINDOW.  The mirror
+ * (allocated on first use) is mapped twice in a row, so the bytes held are
+ * contiguous in the mapping wherever they start.  Called with the mm's
+ * mmap_lock held, which aesd_write() may take (by faulting) while holding
+ * lock, so only mirror_lock (and resize_sem inside it) is taken here.
+ * @return 0 if successful, negative if error occurred:
+ *   -EACCES if the mapping is writable
+ *   -EINVAL if it starts at an offset or is over twice the mirror
+ *   -ENODEV if there's no byte limit
+ *   -ENOMEM if the mirror could not be allocated
+ */
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *p_aesd_dev = ((struct aesd_file *) filp->private_data)->dev;
+    unsigned long len = vma->vm_end - vma->vm_start, off;
+    int retval;
+
+    if (vma->vm_flags & VM_WRITE) {
+	return -EACCES;
+    }
+    if (vma->vm_pgoff) {
+	return -EINVAL;
+    }
+    // No mprotect() to writable later
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+    if (mutex_lock_interruptible(&p_aesd_dev->mirror_lock)) {
+	return -EINTR;
+    }
+    if ((retval = aesd_mirror_alloc(p_aesd_dev))) {
+	goto unlock;
+    }
+    if (len > 2 * p_aesd_dev->mirror_size) {
+	retval = -EINVAL;
+	goto unlock;
+    }
+    for (off = 0; (off < len) && !retval; off += PAGE_SIZE) {
+	retval = vm_insert_page(vma, vma->vm_start + off,
+				vmalloc_to_page(p_aesd_dev->mirror +
+						(off & (p_aesd_dev->mirror_size - 1))));
+    }
+    PDEBUG("mmap %lu bytes, retval %d", len, retval);
+
+unlock:
+    mutex_unlock(&p_aesd_dev->mirror_lock);
+    return retval;
+}
+
+/*
+ * Report @param filp readable if there's data past the stream offset its
+ * last read or seek left it at, for poll()/select()/epoll.  Writes never
+ * wait, so it's always writable.
+ */
+static __poll_t aesd_poll(struct file *filp, poll_table *wait)
+{
+    struct aesd_file *p_file = (struct aesd_file *) filp->private_data;
+    struct aesd_dev *p_aesd_dev = p_file->dev;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filp, &p_aesd_dev->wait, wait);
+    // Not filp->f_pos, which may only be read under f_pos_lock
+    if (READ_ONCE(p_file->next) < aesd_end_offset(p_aesd_dev)) {
+	mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    return mask;
+}
+
 struct file_operations aesd_fops = {
     .owner          = THIS_MODULE,
     .llseek         = aesd_llseek,
-    .read           = aesd_read,
+    .read_iter      = aesd_read_iter,
+    .splice_read    = aesd_splice_read,
     .write          = aesd_write,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+    .mmap           = aesd_mmap,
+    .poll           = aesd_poll,
     .open           = aesd_open,
     .release        = aesd_release,
 };
@@ -352,23 +1062,56 @@ int aesd_init_module(void)
     aesd_device.partial_write.buffptr = NULL;
     aesd_device.partial_write.size = 0;
     mutex_init(&aesd_device.lock);
+    mutex_init(&aesd_device.mirror_lock);
+    init_waitqueue_head(&aesd_device.wait);
+    seqcount_mutex_init(&aesd_device.seq, &aesd_device.lock);
+    if ((result = init_srcu_struct(&aesd_device.srcu))) {
+	goto err_region;
+    }
+    if ((result = percpu_init_rwsem(&aesd_device.resize_sem))) {
+	goto err_srcu;
+    }
+    // Not live yet, but seq expects writers to hold the lock
+    mutex_lock(&aesd_device.lock);
+    if (ring_entries != AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+	result = aesd_set_capacity(&aesd_device, ring_entries);
+	if (result) {
+	    mutex_unlock(&aesd_device.lock);
+	    printk(KERN_WARNING "aesdchar: can't hold %u writes\n",
+		   ring_entries);
+	    goto err_rwsem;
+	}
+    }
+    aesd_set_max_bytes(&aesd_device, max_bytes);
+    mutex_unlock(&aesd_device.lock);
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
-        unregister_chrdev_region(dev, 1);
+        if (aesd_device.circ_buf.entry != aesd_device.circ_buf.default_entry) {
+            kvfree(aesd_device.circ_buf.entry);
+        }
+        goto err_rwsem;
     }
     PDEBUG("aesd_init_module(), result=%d, &aesd_device = %p", result,
 	   &aesd_device);
 
     return result;
 
+err_rwsem:
+    percpu_free_rwsem(&aesd_device.resize_sem);
+err_srcu:
+    cleanup_srcu_struct(&aesd_device.srcu);
+err_region:
+    unregister_chrdev_region(dev, 1);
+    return result;
+
 }
 
 void aesd_cleanup_module(void)
 {
     dev_t devno = MKDEV(aesd_major, aesd_minor);
-    uint8_t index;
+    uint32_t index;
     struct aesd_buffer_entry *entry;
 
     cdev_del(&aesd_device.cdev);
@@ -385,21 +1128,29 @@ void aesd_cleanup_module(void)
     AESD_CIRCULAR_BUFFER_FOREACH(entry,&aesd_device.circ_buf,index) {
 	PDEBUG("aesd_cleanup_module, index = %d, entry->buffptr = %p",
 	       index, entry->buffptr);
-	if (entry->buffptr) {
-	    kfree(entry->buffptr);
-	}
+	aesd_buf_free(entry->buffptr);
+    }
+    if (aesd_device.circ_buf.entry != aesd_device.circ_buf.default_entry) {
+	kvfree(aesd_device.circ_buf.entry);
     }
 
     // Last PDEBUG seems to get lost, so use a dummy one here...
     PDEBUG("");
 
     // Don't need to check for bufptr == NULL, kfree(NULL) is nop
-    if (aesd_device.partial_write.buffptr) {
-	kfree(aesd_device.partial_write.buffptr);
+    kfree(aesd_device.partial_write.buffptr);
+    if (aesd_device.frag_page) {
+	put_page(aesd_device.frag_page);
     }
+    aesd_mirror_free(&aesd_device);
 
     mutex_unlock(&aesd_device.lock);
 
+    // Wait for the buffers writers retired, then tear down what readers used
+    srcu_barrier(&aesd_device.srcu);
+    cleanup_srcu_struct(&aesd_device.srcu);
+    percpu_free_rwsem(&aesd_device.resize_sem);
+
     unregister_chrdev_region(devno, 1);
 }
 
@@ -0,0 +1,383 @@
+//////////////////////////////////////////////////////////////////////
+//
+// Thomas Ames
+// ECEA 5305, load generator for aesdsocket.c
+//
+// Opens a number of concurrent connections to aesdsocket, sends
+// packets of a given size (and rate) on each, checks every reply, and
+// prints throughput and latency percentiles as a single JSON object on
+// stdout.  Works against either data file backend; use -b for
+// /dev/aesdchar, whose history is bounded.
+//
+// Each reply must end with the packet just sent - packets carry the
+// connection and sequence number, so that's unambiguous.  Without -b,
+// the data file only ever grows, so the previous reply on a connection
+// must also be a prefix of the next.
+//
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define DEFAULT_HOST		"127.0.0.1"
+#define DEFAULT_PORT		"9000"
+#define DEFAULT_CONNECTIONS	10
+#define DEFAULT_PACKETS		100
+#define DEFAULT_PACKET_SIZE	64
+#define PACKET_ID_MAX_STRLEN	40
+#define RECV_BUF_INIT_SIZE	4096
+#define NSEC_PER_SEC		1000000000L
+
+// Settings shared by every connection thread
+struct bench_config {
+    const char *host;
+    const char *port;
+    int connections;
+    int packets;		// Per connection
+    size_t packet_size;		// Including the newline
+    double rate;		// Packets/sec per connection, 0 = unpaced
+    int bounded_history;	// -b, /dev/aesdchar backend
+};
+
+// One connection's thread and results
+struct bench_thread_data {
+    pthread_t thread_id;
+    const struct bench_config *p_config;
+    int conn_num;
+    long *latency_ns;		// One per packet sent
+    int packets_done;
+    size_t reply_bytes;
+    int errors;
+};
+
+// Nanoseconds on the monotonic clock
+long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// Connect to host:port.  Returns a socket fd, -1 on error.
+int bench_connect(const char *host, const char *port)
+{
+    struct addrinfo hints, *server_addr, *p_addr;
+    int sock_fd = -1;
+
+    bzero(&hints, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &server_addr)) {
+	perror("getaddrinfo");
+	return -1;
+    }
+    for (p_addr = server_addr; p_addr; p_addr = p_addr->ai_next) {
+	sock_fd = socket(p_addr->ai_family, p_addr->ai_socktype,
+			 p_addr->ai_protocol);
+	if (-1 == sock_fd) {
+	    continue;
+	}
+	if (!connect(sock_fd, p_addr->ai_addr, p_addr->ai_addrlen)) {
+	    break;
+	}
+	close(sock_fd);
+	sock_fd = -1;
+    }
+    freeaddrinfo(server_addr);
+    if (-1 == sock_fd) {
+	perror("connect");
+    }
+    return sock_fd;
+}
+
+// Send all len bytes of buf.  Returns 0 on success, -1 on error.
+int send_all(int sock_fd, const char *buf, size_t len)
+{
+    ssize_t bytes_sent;
+
+    while (len) {
+	bytes_sent = send(sock_fd, buf, len, MSG_NOSIGNAL);
+	if (-1 == bytes_sent) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    perror("send");
+	    return -1;
+	}
+	buf += bytes_sent;
+	len -= bytes_sent;
+    }
+    return 0;
+}
+
+// Receive until the data in *p_buf ends with packet, growing *p_buf
+// (of *p_size bytes) as needed.  *p_len is set to the reply length.
+// Returns 0 on success, -1 on error or if the server closed first.
+int recv_reply(int sock_fd, char **p_buf, size_t *p_size, size_t *p_len,
+	       const char *packet, size_t packet_len)
+{
+    ssize_t bytes_read;
+    char *new_buf;
+    size_t len = 0;
+
+    while ((len < packet_len) ||
+	   memcmp(*p_buf + len - packet_len, packet, packet_len)) {
+	if (len == *p_size) {
+	    if (!(new_buf = realloc(*p_buf, *p_size * 2))) {
+		perror("realloc");
+		return -1;
+	    }
+	    *p_buf = new_buf;
+	    *p_size *= 2;
+	}
+	bytes_read = recv(sock_fd, *p_buf + len, *p_size - len, 0);
+	if (-1 == bytes_read) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    perror("recv");
+	    return -1;
+	} else if (0 == bytes_read) {
+	    fprintf(stderr, "Connection closed before reply completed\n");
+	    return -1;
+	}
+	len += bytes_read;
+    }
+    *p_len = len;
+    return 0;
+}
+
+// Thread for one connection.  Sends the packets, pacing them if a rate
+// was given, and checks and times each reply.
+void *bench_thread(void *arg)
+{
+    struct bench_thread_data *p_thread_data = (struct bench_thread_data *)arg;
+    const struct bench_config *p_config = p_thread_data->p_config;
+    char *packet = NULL, *reply = NULL, *prev_reply = NULL, *tmp;
+    size_t reply_size = RECV_BUF_INIT_SIZE, prev_size = RECV_BUF_INIT_SIZE;
+    size_t reply_len, prev_len = 0, tmp_size;
+    long long start_ns, send_ns, interval_ns;
+    struct timespec next_send;
+    int sock_fd, seq, id_len;
+
+    if (!(packet = malloc(p_config->packet_size)) ||
+	!(reply = malloc(reply_size)) || !(prev_reply = malloc(prev_size))) {
+	perror("malloc");
+	p_thread_data->errors++;
+	goto free_bufs;
+    }
+    if (-1 == (sock_fd = bench_connect(p_config->host, p_config->port))) {
+	p_thread_data->errors++;
+	goto free_bufs;
+    }
+
+    interval_ns = (p_config->rate > 0) ? NSEC_PER_SEC / p_config->rate : 0;
+    start_ns = now_ns();
+    for (seq = 0; seq < p_config->packets; seq++) {
+	if (interval_ns) {
+	    send_ns = start_ns + seq * interval_ns;
+	    next_send.tv_sec = send_ns / NSEC_PER_SEC;
+	    next_send.tv_nsec = send_ns % NSEC_PER_SEC;
+	    while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					    &next_send, NULL))
+		;
+	}
+
+	// "bench <conn> <seq> xxx...\n", padded out to packet_size
+	id_len = snprintf(packet, p_config->packet_size, "bench %d %d ",
+			  p_thread_data->conn_num, seq);
+	if ((size_t) id_len < p_config->packet_size - 1) {
+	    memset(packet + id_len, 'x', p_config->packet_size - 1 - id_len);
+	}
+	packet[p_config->packet_size - 1] = '\n';
+
+	send_ns = now_ns();
+	if (send_all(sock_fd, packet, p_config->packet_size) ||
+	    recv_reply(sock_fd, &reply, &reply_size, &reply_len, packet,
+		       p_config->packet_size)) {
+	    p_thread_data->errors++;
+	    break;
+	}
+	p_thread_data->latency_ns[seq] = now_ns() - send_ns;
+	p_thread_data->packets_done++;
+	p_thread_data->reply_bytes += reply_len;
+
+	// The reply ends with our packet (recv_reply() waited for that),
+	// and the data file only grows unless the history is bounded.
+	if (!p_config->bounded_history &&
+	    ((reply_len < prev_len) || memcmp(reply, prev_reply, prev_len))) {
+	    fprintf(stderr, "Connection %d packet %d: history changed\n",
+		    p_thread_data->conn_num, seq);
+	    p_thread_data->errors++;
+	}
+	// Keep this reply for the next check by swapping buffers
+	tmp = prev_reply;
+	prev_reply = reply;
+	reply = tmp;
+	tmp_size = prev_size;
+	prev_size = reply_size;
+	reply_size = tmp_size;
+	prev_len = reply_len;
+    }
+    close(sock_fd);
+
+free_bufs:
+    free(packet);
+    free(reply);
+    free(prev_reply);
+    return arg;
+}
+
+// qsort comparison for latencies
+int compare_long(const void *p_a, const void *p_b)
+{
+    long a = *(const long *) p_a, b = *(const long *) p_b;
+
+    return (a > b) - (a < b);
+}
+
+// Latency at percentile pct (0-100) of num sorted samples, in usec
+double percentile_us(const long *sorted, size_t num, double pct)
+{
+    size_t index;
+
+    if (!num) {
+	return 0;
+    }
+    index = (size_t) (pct / 100.0 * num);
+    if (index >= num) {
+	index = num - 1;
+    }
+    return sorted[index] / 1000.0;
+}
+
+void usage(const char *prog)
+{
+    fprintf(stderr,
+	    "Usage: %s [-H host] [-p port] [-c connections] [-n packets]\n"
+	    "          [-s packet_size] [-r packets_per_sec] [-b]\n"
+	    "  -n  packets per connection\n"
+	    "  -s  bytes per packet, including the newline\n"
+	    "  -r  send rate per connection, 0 for as fast as replies allow\n"
+	    "  -b  bounded history (/dev/aesdchar), skip the prefix check\n",
+	    prog);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config config;
+    struct bench_thread_data *p_threads;
+    long *latency_ns;
+    long long start_ns, elapsed_ns;
+    size_t num_samples = 0, reply_bytes = 0;
+    int arg, i, errors = 0;
+    double elapsed_s;
+
+    config.host = DEFAULT_HOST;
+    config.port = DEFAULT_PORT;
+    config.connections = DEFAULT_CONNECTIONS;
+    config.packets = DEFAULT_PACKETS;
+    config.packet_size = DEFAULT_PACKET_SIZE;
+    config.rate = 0;
+    config.bounded_history = 0;
+    while ((arg = getopt(argc, argv, "H:p:c:n:s:r:b")) != -1)
+	switch (arg)
+	{
+	case 'H':
+	    config.host = optarg;
+	    break;
+	case 'p':
+	    config.port = optarg;
+	    break;
+	case 'c':
+	    config.connections = atoi(optarg);
+	    break;
+	case 'n':
+	    config.packets = atoi(optarg);
+	    break;
+	case 's':
+	    config.packet_size = strtoul(optarg, NULL, 0);
+	    break;
+	case 'r':
+	    config.rate = atof(optarg);
+	    break;
+	case 'b':
+	    config.bounded_history = 1;
+	    break;
+	default:
+	    usage(argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    // Packets need room for their id to stay unique
+    if ((config.connections < 1) || (config.packets < 1) ||
+	(config.packet_size < PACKET_ID_MAX_STRLEN)) {
+	fprintf(stderr, "Need at least 1 connection and packet, and "
+		"packets of at least %d bytes\n", PACKET_ID_MAX_STRLEN);
+	exit(EXIT_FAILURE);
+    }
+
+    if (!(p_threads = calloc(config.connections,
+			     sizeof(struct bench_thread_data))) ||
+	!(latency_ns = calloc((size_t) config.connections * config.packets,
+			      sizeof(long)))) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+
+    start_ns = now_ns();
+    for (i = 0; i < config.connections; i++) {
+	p_threads[i].p_config = &config;
+	p_threads[i].conn_num = i;
+	p_threads[i].latency_ns = latency_ns + (size_t) i * config.packets;
+	if (pthread_create(&p_threads[i].thread_id, NULL, bench_thread,
+			   (void *) &p_threads[i])) {
+	    perror("pthread_create");
+	    exit(EXIT_FAILURE);
+	}
+    }
+    for (i = 0; i < config.connections; i++) {
+	pthread_join(p_threads[i].thread_id, NULL);
+    }
+    elapsed_ns = now_ns() - start_ns;
+    elapsed_s = elapsed_ns / (double) NSEC_PER_SEC;
+
+    // Pack every connection's samples together and sort them
+    for (i = 0; i < config.connections; i++) {
+	memmove(latency_ns + num_samples, p_threads[i].latency_ns,
+		p_threads[i].packets_done * sizeof(long));
+	num_samples += p_threads[i].packets_done;
+	reply_bytes += p_threads[i].reply_bytes;
+	errors += p_threads[i].errors;
+    }
+    qsort(latency_ns, num_samples, sizeof(long), compare_long);
+
+    printf("{\"connections\": %d, \"packets_per_connection\": %d, "
+	   "\"packet_size\": %zu, \"rate\": %g, "
+	   "\"packets\": %zu, \"errors\": %d, \"elapsed_s\": %.6f, "
+	   "\"packets_per_s\": %.1f, \"reply_bytes_per_s\": %.1f, "
+	   "\"latency_us\": {\"min\": %.1f, \"p50\": %.1f, \"p99\": %.1f, "
+	   "\"p999\": %.1f, \"max\": %.1f}}\n",
+	   config.connections, config.packets, config.packet_size, config.rate,
+	   num_samples, errors, elapsed_s,
+	   num_samples / elapsed_s, reply_bytes / elapsed_s,
+	   percentile_us(latency_ns, num_samples, 0),
+	   percentile_us(latency_ns, num_samples, 50),
+	   percentile_us(latency_ns, num_samples, 99),
+	   percentile_us(latency_ns, num_samples, 99.9),
+	   percentile_us(latency_ns, num_samples, 100));
+
+    free(latency_ns);
+    free(p_threads);
+    exit(errors ? EXIT_FAILURE : EXIT_SUCCESS);
+}
@@ -5,7 +5,7 @@
 // July 2023
 //
 
-#define _GNU_SOURCE		// To get strchrnul
+#define _GNU_SOURCE		// To get strchrnul, splice, pipe2
 
 #include <stdio.h>
 #include <stddef.h>
@@ -19,40 +19,85 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <getopt.h>
 #include "../aesd-char-driver/aesd_ioctl.h"
 
+// The uring mode needs io_uring headers from Linux 6.0 or later (direct
+// accept into the fixed file table).  Without them it isn't built.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_FILE_INDEX_ALLOC
+#define USE_IO_URING		1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif // IORING_FILE_INDEX_ALLOC
+#endif // __has_include(<linux/io_uring.h>)
+#endif // __has_include
+
 //#define DEBUG 1
 #undef DEBUG
 
+// Default backend, see -B
 #define USE_AESD_CHAR_DEVICE	1
 //#undef USE_AESD_CHAR_DEVICE
 
-#define TCP_PORT "9000"
-#define SOCKET_LISTEN_BACKLOG	5
-#define IP_ADDR_MAX_STRLEN	20
+#define TCP_PORT "9000"			// Default, see -p
+#define SOCKET_LISTEN_BACKLOG	5	// Default, see -b
+#define IP_ADDR_MAX_STRLEN	INET6_ADDRSTRLEN
 #define TIME_MAX_STRLEN		100
-#define SOCK_READ_BUF_SIZE	1000
-#ifdef USE_AESD_CHAR_DEVICE
-#define DATAFILE_NAME		"/dev/aesdchar"
-#define DATAFILE_FLAGS		(O_RDWR)
-#define DATAFILE_MODE		0	// Not used for /dev/aesdchar
-#else // USE_AESD_CHAR_DEVICE
+#define SOCK_READ_BUF_SIZE	1000	// Default, see -R
+#define AESDCHAR_NAME		"/dev/aesdchar"
 #define DATAFILE_NAME		"/var/tmp/aesdsocketdata"
-#define DATAFILE_FLAGS		(O_CREAT | O_APPEND | O_RDWR)
+// No O_APPEND - appends go to the end tracked in struct datafile, see
+// datafile_append().  The file backend adds O_CREAT.
+#define DATAFILE_FLAGS		(O_RDWR)
 #define DATAFILE_MODE		(S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
-#endif // USE_AESD_CHAR_DEVICE
-#define TIMESTAMP_DELAY_SECS	10
+#define TIMESTAMP_INTERVAL_MS	10000	// Default for the data file, see -T
+#define EPOLL_MAX_EVENTS	64
+#define FRAMER_SHRINK_SIZE	(64 * 1024)
+#define MAX_PACKET_SIZE		(64 * 1024 * 1024)
+#define SERVER_THREAD_STACK_SIZE (64 * 1024)
+#define PACKET_BATCH_MAX	32	// Packets handled per lock acquisition
+#define POOL_QUEUE_LEN		64	// Default, see -q
+#define POOL_THREADS_PER_CPU	8	// Default pool size, see -t
+#define DRAIN_TIMEOUT_SECS	5	// Default, see -w
+#define STATS_LATENCY_BUCKETS	24	// log2 usec, the last is open ended
+#define STATS_MAX_STRLEN	2048
+#define SNAPSHOT_PIPE_MAX	(1024 * 1024)	// Larger snapshots go to memory
+#define URING_MAX_CONNS		256	// Default uring connections, see -c
+#define URING_CHUNK_SIZE	(16 * 1024) // Default reply buffer per conn, see -U
+#define URING_ACCEPT_DEPTH	8	// Accepts kept posted
+#define URING_LISTEN_FILE	0	// Fixed file table layout
+#define URING_DATAFILE_FILE	1
+#define URING_FIRST_CONN_FILE	2
 
 // Not a #def, since that would create multiple static strings on each
 // reference.  Need to use the same one for strchr ptr math to work.
 const char *IOCSEEKTO_CMD_STR = "AESDCHAR_IOCSEEKTO:%d,%d";
 #define IOCSEEKTO_CMD_STRLEN	(strchr(IOCSEEKTO_CMD_STR,':')-IOCSEEKTO_CMD_STR)
+// Turns incremental (delta) replies on (1) or off (0) for a connection
+const char *DELTA_CMD_STR = "AESDSOCKET_DELTA:%d";
+#define DELTA_CMD_STRLEN	(strchr(DELTA_CMD_STR,':')-DELTA_CMD_STR)
+// Replies with the server statistics instead of the data file
+const char *STATS_CMD_STR = "AESDSOCKET_STATS";
+#define STATS_CMD_STRLEN	(strlen(STATS_CMD_STR))
 
 #ifdef DEBUG
 #define PRINTF(...) printf(__VA_ARGS__)
@@ -60,27 +105,331 @@ const char *IOCSEEKTO_CMD_STR = "AESDCHAR_IOCSEEKTO:%d,%d";
 #define PRINTF(...)
 #endif
 
+// Data file storage shared by all threads.  The data file is opened
+// once and the descriptor kept for the life of the server, unless
+// reopen is set (-r), in which case it is opened and closed around
+// every access so the aesdchar module can be unloaded while idle.
+struct datafile {
+    pthread_rwlock_t lock;	// Held exclusively to append
+    const char *name;
+    int flags;			// open() flags
+    int fd;			// Persistent descriptor, -1 if reopen
+    int reopen;
+    int is_regular;		// Regular file, not the char device
+    int remove_on_exit;		// Created by us, see datafile_remove()
+    off_t size;			// Bytes appended to a regular file
+    off_t committed;		// Bytes of size written, short of a uring
+				// append in flight; replies end here
+    // Set (with __atomic, from any thread) once sendfile() from the
+    // regular file or splice() from the char device fails with
+    // EINVAL/ENOSYS, after which replies copy through user space.
+    int sendfile_unsupported;
+    int splice_unsupported;
+};
+
+// Where the data goes, selected with -B
+enum datafile_backend {
+    BACKEND_AESDCHAR,		// The aesdchar driver, AESDCHAR_NAME
+    BACKEND_FILE,		// A regular file, DATAFILE_NAME
+};
+
+// Packet types.  Anything that isn't an inline command is data.
+enum packet_type {
+    PACKET_DATA,		// Append to the data file
+    PACKET_SEEKTO,		// IOCSEEKTO_CMD_STR
+    PACKET_DELTA,		// DELTA_CMD_STR
+    PACKET_STATS,		// STATS_CMD_STR
+};
+
+// A received packet, parsed by parse_packet()
+struct packet_cmd {
+    enum packet_type type;
+    uint32_t write_cmd;		// PACKET_SEEKTO arguments
+    uint32_t write_cmd_offset;
+    int delta_on;		// PACKET_DELTA argument
+    off_t append_end;		// End of a PACKET_DATA append (regular file)
+};
+
+// A reply to a packet, captured under the data file lock and sent
+// without it.  The sources are sent in this order; a char device
+// snapshot that didn't all fit in the pipe continues in buf.
+struct reply {
+    int fd;			// Regular data file range: fd, or -1
+    off_t offset;		// Next byte of fd to send
+    off_t end;			// End of the range in fd
+    int *pipe_fds;		// Char device snapshot in the session's
+				// pipe, or NULL
+    size_t pipe_len;		// Bytes left in the pipe
+    char *buf;			// Snapshot in memory, or NULL
+    size_t len;
+    size_t sent;
+    long long start_ns;		// When the packet arrived, 0 = not timed
+};
+
+// Protocol state kept for each client connection, whichever way the
+// connection is being serviced.
+struct client_session {
+    int delta_mode;		// Only send data the client hasn't seen
+    off_t delta_cursor;		// End of the last reply sent in delta mode,
+				// a stream offset for the char device
+    // Char device snapshots waiting to be sent, in reply order, see
+    // snapshot_to_pipe().  Made on first use, closed by session_free().
+    int pipe_open;
+    int pipe_fds[2];
+};
+
+// The complete packets from one recv(), handled under a single
+// acquisition of the data file lock, and the replies captured for them.
+// Replies to back to back data packets in delta mode cover adjacent
+// ranges of the data file and are merged, so there may be fewer
+// replies than packets.
+struct packet_batch {
+    int num_packets;
+    char *packets[PACKET_BATCH_MAX];	// In the framer's buffer
+    size_t packet_lens[PACKET_BATCH_MAX];
+    struct packet_cmd cmds[PACKET_BATCH_MAX];
+    int num_replies;
+    int next_reply;		// Next reply to send
+    struct reply replies[PACKET_BATCH_MAX];
+};
+
+// Splits the byte stream from a client into newline terminated packets.
+// The buffer grows geometrically, each byte is searched for a newline
+// only once, and any number of packets can arrive in one recv().
+struct packet_framer {
+    char *buf;
+    size_t size;		// Allocated size of buf
+    size_t start;		// Offset of the next packet in buf
+    size_t len;			// Offset of the first free byte in buf
+    size_t scan_pos;		// Bytes before this searched for '\n'
+    size_t max_packet_size;	// Longest packet accepted, 0 = no limit
+    size_t min_size;		// Initial size, shrunk back to when idle
+};
+
 // Thread data passed between main thread and server thread
 struct server_thread_data {
     pthread_t thread_id;
-    pthread_mutex_t *p_file_mutex;
+    struct datafile *p_datafile;
     int conn_fd;
     // get rid of sock_fd. threads should not call cleaup routine directly
     int sock_fd;
     int client_done;
+    const struct server_config *p_config;
+    struct client_session session;
     char client_ip_addr_str[IP_ADDR_MAX_STRLEN];
     char client_port_str[IP_ADDR_MAX_STRLEN];
-    SLIST_ENTRY(server_thread_data) entries;
+    struct thread_completions *p_completions;
+    LIST_ENTRY(server_thread_data) entries;	// main's or the pool's
+						// active list
+    SLIST_ENTRY(server_thread_data) done_entries;
 };
 
-// Thread data passed between main thread and server thread
-struct timestamp_thread_data {
+// Server threads that have finished, waiting for main to join them.  A
+// thread queues itself as its last act and bumps event_fd, so main can
+// poll() for it alongside the listening socket and reap right away.
+struct thread_completions {
+    pthread_mutex_t lock;
+    SLIST_HEAD(, server_thread_data) done;
+    int event_fd;
+};
+
+// Periodic "timestamp:" records, see init_timestamp_timer()
+struct timestamp_timer {
+    int timer_fd;		// -1 if timestamps are off
+    long interval_ms;
+    struct datafile *p_datafile;
+};
+
+// Thread data for pool threads that accept for themselves (-P)
+struct pool_listener {
+    pthread_t thread_id;
+    int listen_fd;		// Own SO_REUSEPORT listener
+    struct datafile *p_datafile;
+    const struct server_config *p_config;
+    struct conn_queue *p_queue;	// Only for the active list
+};
+
+// Thread data passed between main thread and epoll event loop threads.
+// Each event loop thread owns the connections in its own epoll set.
+struct epoll_thread_data {
     pthread_t thread_id;
-    pthread_mutex_t *p_file_mutex;
+    struct datafile *p_datafile;
+    const struct server_config *p_config;
+    int epoll_fd;
+    int listen_fd;		// Own SO_REUSEPORT listener (-P), or -1
+    int waiting_for_slot;	// Watching conn_slots_fd, not listen_fd
+    pthread_mutex_t conns_lock;	// main adds connections too
+    LIST_HEAD(, epoll_conn_data) conns;
+    int draining;		// Set under conns_lock
+    long long deadline_ns;	// Connections still open then are closed
+};
+
+// Per connection state for the epoll event loop, one per conn_fd.
+// Only touched by the event loop thread that owns the conn_fd.
+struct epoll_conn_data {
+    int conn_fd;
+    LIST_ENTRY(epoll_conn_data) entries;	// Owner's conns
+    struct datafile *p_datafile;
+    struct client_session session;
+    struct packet_framer framer;
+    struct packet_batch batch;	// Replies being sent, if batch_pending()
+    char client_ip_addr_str[IP_ADDR_MAX_STRLEN];
+    char client_port_str[IP_ADDR_MAX_STRLEN];
+};
+
+#ifdef USE_IO_URING
+// An io_uring submission and completion queue pair, mapped from the
+// kernel and driven with the raw syscalls (liburing isn't on the target).
+struct uring {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_local_tail;	// Tail including SQEs not yet published
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// Operation tags, kept in the low bits of each SQE's user_data.  The
+// rest is the uring_conn the operation belongs to, if any.
+enum uring_op {
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_APPEND,
+    URING_OP_READ,
+    URING_OP_SEND,
+    URING_OP_SPLICE,
+    URING_OP_CLOSE,
+    URING_OP_TIMER,		// Poll on the timestamp timer, no conn
+    URING_OP_SIGNAL,		// Poll on signal_fd, no conn
+    URING_OP_SHUTDOWN,		// Draining, on top of the conn's own op
+    URING_OP_DEADLINE,		// Drain timeout, no conn
+};
+#define URING_OP_MASK		15
+
+// Per connection state for the uring event loop.  The socket only
+// exists in the ring's fixed file table, and at most one operation is
+// in flight for a connection at a time.
+struct uring_conn {
+    int slot;			// Index in uring_server conns and buffers
+    int is_open;		// Accepted and not closed yet
+    struct client_session session;
+    struct packet_framer framer;
+    struct reply reply;		// Reply being sent, if reply_pending()
+    char *packet;		// Data packet waiting to be appended
+    size_t packet_len;
+    off_t append_end;		// Where its append ends in a regular file
+    struct uring_conn *next_append;
+    char *chunk;		// Registered buffer for data file replies
+    size_t chunk_len;
+    size_t chunk_sent;
+    struct sockaddr_storage client_addr; // Filled in by accept
+    socklen_t client_addr_len;
+    char client_ip_addr_str[IP_ADDR_MAX_STRLEN];
+    char client_port_str[IP_ADDR_MAX_STRLEN];
+} __attribute__((aligned(URING_OP_MASK + 1)));	// Room for the op tag
+
+// State for the uring event loop.  Data packets from all connections
+// are appended in batches, one writev in flight at a time, so a batch
+// that completes has everything before it in the file too.
+struct uring_server {
+    struct uring ring;
+    struct datafile *p_datafile;
+    const struct server_config *p_config;
+    struct uring_conn *conns;	// One per connection slot
+    int *free_slots;		// Stack of unused conns
+    int num_free_slots;
+    int buffers_registered;	// conn chunks are fixed buffers
+    int accepts_posted;
+    int num_open;		// conns with is_open set
+    int listen_fd;
+    int draining;		// Stopped accepting on a signal
+    struct __kernel_timespec drain_timeout;
+    struct uring_conn *append_head;	// Queued data packets
+    struct uring_conn **append_tail;
+    struct uring_conn *append_batch;	// Data packets being written
+    off_t append_offset;		// Where, in a regular file
+    size_t append_len;
+    struct iovec append_iov[IOV_MAX];
+};
+#endif // USE_IO_URING
+
+// Server statistics, bumped with relaxed atomics from every thread and
+// reported by STATS_CMD_STR.  Active connections are accepted - closed.
+struct server_stats {
+    unsigned long conns_accepted;
+    unsigned long conns_closed;
+    unsigned long conns_rejected;	// Closed unserved, pool queue full
+    unsigned long packets_in;
+    unsigned long bytes_in;
+    unsigned long replies_out;
+    unsigned long bytes_out;
+    unsigned long lock_acquires;
+    unsigned long lock_wait_ns;	// Total time spent waiting for the lock
+    // Packet arrival to reply sent, bucket i counts [2^i, 2^(i+1)) usec
+    unsigned long reply_latency_us[STATS_LATENCY_BUCKETS];
+};
+#define STATS_ADD(field, n)	__atomic_fetch_add(&stats.field, (n), \
+						   __ATOMIC_RELAXED)
+#define STATS_GET(field)	__atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+// Connections accepted by main and waiting for a SERVER_MODE_POOL
+// worker thread, a ring of capacity entries, and the ones the workers
+// are serving, so main can drain them on a signal.
+struct conn_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t worker_done;	// num_workers went down
+    struct server_thread_data **entries;
+    int capacity;
+    int head;
+    int count;
+    LIST_HEAD(, server_thread_data) active;
+    int num_workers;		// Still running
+    int draining;		// Workers exit once the queue is empty
+};
+
+// Connection handling mode, selected with -m on the command line
+enum server_mode {
+    SERVER_MODE_THREAD,		// One server_thread per connection
+    SERVER_MODE_EPOLL,		// Fixed number of epoll event loop threads
+    SERVER_MODE_URING,		// Single io_uring event loop
+    SERVER_MODE_POOL,		// Fixed pool of threads, queued connections
+};
+
+// Run time settings, from the command line and config files, see
+// config_parse().  Read only once the server is running.
+struct server_config {
+    int daemonize;
+    enum server_mode mode;
+    char port[NI_MAXSERV];
+    int listen_backlog;
+    int reuseport;		// A listener per epoll/pool thread
+    enum datafile_backend backend;
+    char datafile_name[PATH_MAX];
+    int reopen_datafile;	// -1 = default for the backend
+    int num_threads;		// epoll or pool threads
+    int max_connections;	// 0 = no limit
+    int pool_queue_len;
+    size_t max_packet_size;	// 0 = no limit
+    size_t recv_buf_size;	// Initial receive buffer per connection
+    size_t uring_chunk_size;	// Reply buffer per uring connection
+    int drain_secs;
+    long timestamp_ms;		// 0 = no timestamps
 };
 
 int caught_signal = 0;
 
+// SIGINT/SIGTERM once they're blocked, see open_signal_fd()
+int signal_fd = -1;
+
+// Connection slots, see init_conn_slots()
+int conn_slots_fd = -1;
+
+struct timestamp_timer timestamp_timer = { .timer_fd = -1 };
+
+struct server_stats stats;
+
 // Simple signal handler; sets global flag to non-zero on caught signal
 // Realistically, this will never get called, as we will probably only
 // see a ctrl-C while waiting in accept or recv.  In those cases, since
@@ -108,61 +457,162 @@ void setup_signals()
 	perror("sigaction SIGTERM");
 	exit(EXIT_FAILURE);
     }
+    // A client that disconnects mid-reply makes sendfile/splice raise
+    // SIGPIPE, which would kill the whole server.  Get EPIPE instead.
+    new_sigaction.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &new_sigaction, NULL)) {
+	perror("sigaction SIGPIPE");
+	exit(EXIT_FAILURE);
+    }
 }
 
-// Handle initial portions of socket setup - socket, bind, listen calls.
-// Returns a socket fd on success that can be passed to accept on success,
-// exits on error.
-int socket_init()
+// Take SIGINT/SIGTERM through signal_fd from here on.  They're blocked
+// in main, and every thread started after inherits that, so a signal
+// stays pending on signal_fd for whichever loop is waiting on it.
+// Returns 0 on success, -1 on error.
+int open_signal_fd()
 {
-    int sock_fd, sock_opts;
-    struct addrinfo getaddrinfo_hints;
-    struct addrinfo *server_addr;
+    sigset_t signal_set;
 
-    // socket, bind, listen, accept
-    // Class example uses PF_*, man page says AF_* is the standard
-    // AF_INET = IPv4, AF_INET6 = IPv6
-    if (-1 == (sock_fd = socket(AF_INET, SOCK_STREAM, 0))) {
-	perror("socket");
-	exit(EXIT_FAILURE);
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGINT);
+    sigaddset(&signal_set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &signal_set, NULL)) {
+	perror("pthread_sigmask");
+	return -1;
+    }
+    if (-1 == (signal_fd = signalfd(-1, &signal_set, SFD_CLOEXEC))) {
+	perror("signalfd");
+	return -1;
+    }
+    // One caught by signal_handler before this goes to signal_fd too
+    if (caught_signal) {
+	kill(getpid(), caught_signal);
+    }
+    return 0;
+}
+
+// Nanoseconds on the monotonic clock, for the statistics
+long long monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Block SIGINT and SIGTERM in the calling thread - let main thread
+// handle them.  Returns 0 on success, -1 on error.
+int block_server_signals()
+{
+    sigset_t signal_set;
+
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGINT);
+    sigaddset(&signal_set, SIGTERM);
+    if (pthread_sigmask(SIG_BLOCK, &signal_set, NULL)) {
+	perror("pthread_sigmask");
+	return -1;
+    }
+    return 0;
+}
+
+// Set up attributes for the server's threads.  They get a small,
+// explicit stack rather than the default (8MB of address space each).
+// Returns 0 on success, -1 on error.
+int server_thread_attr_init(pthread_attr_t *p_attr)
+{
+    int status;
+
+    if ((status = pthread_attr_init(p_attr)) ||
+	(status = pthread_attr_setstacksize(p_attr,
+					    SERVER_THREAD_STACK_SIZE))) {
+	errno = status;
+	perror("pthread_attr_setstacksize");
+	return -1;
     }
+    return 0;
+}
+
+// Handle initial portions of socket setup - socket, bind, listen calls.
+// Listens on IPv6 and IPv4 with one dual stack socket where the host
+// has IPv6, otherwise IPv4 only.  With reuseport set, SO_REUSEPORT lets
+// several sockets listen on the port at once, see -P.  Returns a socket
+// fd on success that can be passed to accept on success, exits on error.
+int socket_init(const char *port, int listen_backlog, int reuseport)
+{
+    const int families[] = { AF_INET6, AF_INET };
+    int sock_fd = -1, sock_opts, status, i;
+    struct addrinfo getaddrinfo_hints;
+    struct addrinfo *server_addr, *p_addr;
 
     // Init the hints struct
     bzero(&getaddrinfo_hints, sizeof(struct addrinfo));
-    getaddrinfo_hints.ai_family   = AF_INET;	 // IPv4
+    getaddrinfo_hints.ai_family   = AF_UNSPEC;	 // IPv4 or IPv6
     getaddrinfo_hints.ai_socktype = SOCK_STREAM; // TCP
     getaddrinfo_hints.ai_flags    = AI_PASSIVE;
 
-    // Use getaddrinfo to get the bind address in server_addr.  Must
+    // Use getaddrinfo to get the bind addresses in server_addr.  Must
     // free it with freeaddrinfo(server_addr) to avoid memory leaks
-    if (getaddrinfo(NULL, TCP_PORT, &getaddrinfo_hints, &server_addr)) {
-	perror("getaddrinfo");
-	close(sock_fd);
+    if ((status = getaddrinfo(NULL, port, &getaddrinfo_hints,
+			      &server_addr))) {
+	fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
 	exit(EXIT_FAILURE);
     }
 
-    // Set reuse addr option to eliminate "Address already in use"
-    // error in bind
-    sock_opts = 1;
-    if (-1 == setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &sock_opts,
-			 sizeof(sock_opts))) {
-	perror("setsockopt");
-	exit(EXIT_FAILURE);
-    }
+    // getaddrinfo returns a linked list of addrs in server_addr, the
+    // IPv4 and IPv6 wildcard addresses.  Take the first IPv6 one that
+    // works, then fall back to IPv4.  See the Beej docs,
+    // https://beej.us/guide/bgnet/html/#a-simple-stream-client
+    for (i = 0; (i < 2) && (-1 == sock_fd); i++) {
+	for (p_addr = server_addr; p_addr; p_addr = p_addr->ai_next) {
+	    if (p_addr->ai_family != families[i]) {
+		continue;
+	    }
+	    // socket, bind, listen, accept
+	    // Class example uses PF_*, man page says AF_* is the standard
+	    // AF_INET = IPv4, AF_INET6 = IPv6
+	    if (-1 == (sock_fd = socket(p_addr->ai_family,
+					p_addr->ai_socktype,
+					p_addr->ai_protocol))) {
+		continue;
+	    }
 
-    // Technically, getaddrinfo returns a linked list of addrs in
-    // server_addt, but we are just using the first one.  See
-    // the Beej docs, https://beej.us/guide/bgnet/html/#a-simple-stream-client
-    if (bind(sock_fd, server_addr->ai_addr, server_addr->ai_addrlen)) {
-	perror("bind");
-	freeaddrinfo(server_addr);
-	close(sock_fd);
-	exit(EXIT_FAILURE);
+	    // Set reuse addr option to eliminate "Address already in
+	    // use" error in bind.  IPv4 clients reach an IPv6 socket as
+	    // ::ffff:a.b.c.d unless it's IPv6 only, which some systems
+	    // default to.
+	    sock_opts = 1;
+	    if ((-1 == setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR,
+				  &sock_opts, sizeof(sock_opts))) ||
+		(reuseport &&
+		 (-1 == setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT,
+				   &sock_opts, sizeof(sock_opts))))) {
+		perror("setsockopt");
+		exit(EXIT_FAILURE);
+	    }
+	    sock_opts = 0;
+	    if ((AF_INET6 == p_addr->ai_family) &&
+		(-1 == setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY,
+				  &sock_opts, sizeof(sock_opts)))) {
+		perror("setsockopt IPV6_V6ONLY");
+	    }
+
+	    if (!bind(sock_fd, p_addr->ai_addr, p_addr->ai_addrlen)) {
+		break;
+	    }
+	    perror("bind");
+	    close(sock_fd);
+	    sock_fd = -1;
+	}
     }
 
     freeaddrinfo(server_addr);
+    if (-1 == sock_fd) {
+	exit(EXIT_FAILURE);
+    }
 
-    if (listen(sock_fd, SOCKET_LISTEN_BACKLOG)) {
+    if (listen(sock_fd, listen_backlog)) {
 	perror("listen");
 	close(sock_fd);
 	exit(EXIT_FAILURE);
@@ -170,372 +620,3431 @@ int socket_init()
     return sock_fd;
 }
 
-// Wait for connection from client.  Returns a new fd that client data can be
-// read from, exit's on error.
-int wait_for_client_connection(int sock_fd, char *client_ip_addr_str,
-			       char *client_port_str)
+// Look up the numeric address and port of a client for logging.  An
+// IPv4 client of the dual stack socket shows up as an IPv4 mapped IPv6
+// address; log it as plain IPv4.  Returns 0 on success, -1 on error.
+int client_addr_str(const struct sockaddr *p_addr, socklen_t addr_len,
+		    char *client_ip_addr_str, char *client_port_str)
+{
+    const char *mapped_prefix = "::ffff:";
+
+    if (getnameinfo(p_addr, addr_len,
+		    client_ip_addr_str, IP_ADDR_MAX_STRLEN,
+		    client_port_str, IP_ADDR_MAX_STRLEN,
+		    NI_NUMERICHOST | NI_NUMERICSERV)) {
+	return -1;
+    }
+    if ((AF_INET6 == p_addr->sa_family) &&
+	!strncmp(client_ip_addr_str, mapped_prefix, strlen(mapped_prefix)) &&
+	strchr(client_ip_addr_str, '.')) {
+	memmove(client_ip_addr_str, client_ip_addr_str + strlen(mapped_prefix),
+		strlen(client_ip_addr_str) - strlen(mapped_prefix) + 1);
+    }
+    return 0;
+}
+
+// Accept a connection from a client and look up its address.  Returns
+// the new fd, or -1 with errno set (EINTR on a caught signal, EAGAIN if
+// sock_fd is non-blocking and no client was waiting).
+int accept_client(int sock_fd, char *client_ip_addr_str,
+		  char *client_port_str)
 {
     int conn_fd;
-    struct sockaddr client_addr;
+    struct sockaddr_storage client_addr;
     socklen_t client_addr_len;
 
-    // Wait for client connections.  accept can be interrupted with a
-    // caught SIGINT or SIGTERM; log message if so.
-    client_addr_len = sizeof(struct sockaddr);
-    if (-1 == (conn_fd = accept(sock_fd, &client_addr, &client_addr_len))) {
-	if (EINTR == errno) {
-	    // System call, log message and exit cleanly.  Safe to exit,
-	    // since there isn't a connection to clean up yet.
-	    PRINTF("Caught signal in accept, exiting\n");
-	    close(sock_fd);
-#ifndef USE_AESD_CHAR_DEVICE
-	    unlink(DATAFILE_NAME);
-#endif // USE_AESD_CHAR_DEVICE
-	    syslog(LOG_USER|LOG_INFO,"Caught signal, exiting");
-	    exit(EXIT_SUCCESS);
-	} else {
-	    perror("accept");
-	    close(sock_fd);
-	    exit(EXIT_FAILURE);
-	}
-    } else {
-	// conn_fd == new connection from client.
-	// Use getnameinfo to parse client IP address and port number
-	if (getnameinfo(&client_addr, sizeof(client_addr),
-			client_ip_addr_str, IP_ADDR_MAX_STRLEN,
-			client_port_str, IP_ADDR_MAX_STRLEN,
-			NI_NUMERICHOST | NI_NUMERICSERV)) {
-	    perror("getnameinfo");
-	    shutdown(conn_fd, SHUT_RDWR);
-	    close(conn_fd);
-	    close(sock_fd);
-	    exit(EXIT_FAILURE);
-	}
-	PRINTF("Accepted connection from %s:%s\n", client_ip_addr_str,
-	       client_port_str);
-	syslog(LOG_USER|LOG_INFO, "Accepted connection from %s",
-	       client_ip_addr_str);
+    client_addr_len = sizeof(client_addr);
+    if (-1 == (conn_fd = accept(sock_fd, (struct sockaddr *) &client_addr,
+				&client_addr_len))) {
+	return -1;
     }
-    return(conn_fd);
+    // conn_fd == new connection from client.
+    // Use getnameinfo to parse client IP address and port number
+    if (client_addr_str((struct sockaddr *) &client_addr, client_addr_len,
+			client_ip_addr_str, client_port_str)) {
+	perror("getnameinfo");
+	shutdown(conn_fd, SHUT_RDWR);
+	close(conn_fd);
+	errno = EINVAL;
+	return -1;
+    }
+    PRINTF("Accepted connection from %s:%s\n", client_ip_addr_str,
+	   client_port_str);
+    syslog(LOG_USER|LOG_INFO, "Accepted connection from %s",
+	   client_ip_addr_str);
+    STATS_ADD(conns_accepted, 1);
+    return conn_fd;
 }
 
-int write_data_to_file(char * buf, int size)
+// Open the data file (or note that it is a regular file) and set up
+// the storage shared by all threads.  The file backend starts from an
+// empty file, deleting any left from a previous run.  Returns 0 on
+// success, -1 on error.
+int datafile_init(struct datafile *p_datafile, const char *name,
+		  enum datafile_backend backend, int reopen)
 {
+    pthread_rwlockattr_t lock_attr;
+    struct stat file_stat;
     int file_fd;
 
-    file_fd = open(DATAFILE_NAME, DATAFILE_FLAGS, DATAFILE_MODE);
-    if (-1 == file_fd) {
-	perror("open");
+    // Replies share the lock, so don't let a steady stream of them
+    // starve appends.
+    if (pthread_rwlockattr_init(&lock_attr) ||
+	pthread_rwlockattr_setkind_np(&lock_attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) ||
+	pthread_rwlock_init(&p_datafile->lock, &lock_attr)) {
+	perror("pthread_rwlock_init");
 	return -1;
     }
+    pthread_rwlockattr_destroy(&lock_attr);
 
-    // Write up to (but NOT including) the newline (or '\0')
-    // pointed to by newline_ptr.  Ignore partial writes (fs full)
-    if (-1 == write(file_fd, buf, size)) {
-	perror("write");
-	return (-1);
+    p_datafile->name = name;
+    p_datafile->flags = DATAFILE_FLAGS;
+    if (BACKEND_FILE == backend) {
+	unlink(name);
+	p_datafile->flags |= O_CREAT;
+	p_datafile->remove_on_exit = 1;
     }
-
-    // Now write out a trailing newline.  Done separately instead
-    // of writing +1 above, in case we didn't get a newline in the
-    // received packet (which shouldn't happen, since the
-    // assignment says we always get newline
-    buf[0] = '\n';
-    if (-1 == write(file_fd, buf, 1)) {
-	perror("write");
-	return (-1);
+    file_fd = open(name, p_datafile->flags, DATAFILE_MODE);
+    if (-1 == file_fd) {
+	perror("open");
+	return -1;
     }
-
-    if (-1 == close(file_fd)) {
-	perror("close");
-	return (-1);
+    if (-1 == fstat(file_fd, &file_stat)) {
+	perror("fstat");
+	close(file_fd);
+	return -1;
     }
-
+    p_datafile->is_regular = S_ISREG(file_stat.st_mode);
+    p_datafile->size = p_datafile->is_regular ? file_stat.st_size : 0;
+    p_datafile->committed = p_datafile->size;
+    p_datafile->reopen = reopen;
+    if (reopen) {
+	close(file_fd);
+	file_fd = -1;
+    }
+    p_datafile->fd = file_fd;
     return 0;
 }
 
-int send_data_file_to_client(int conn_fd, char * buf, uint32_t
-			     write_cmd, uint32_t write_cmd_offset)
+// Get a descriptor for the data file; the persistent one, or a freshly
+// opened one in reopen mode.  Release with datafile_put_fd().  Returns
+// -1 on error.
+int datafile_get_fd(struct datafile *p_datafile)
 {
     int file_fd;
-    struct aesd_seekto seekto;
-    int bytes_read;
 
-    file_fd = open(DATAFILE_NAME, DATAFILE_FLAGS, DATAFILE_MODE);
+    if (!p_datafile->reopen) {
+	return p_datafile->fd;
+    }
+    file_fd = open(p_datafile->name, p_datafile->flags, DATAFILE_MODE);
     if (-1 == file_fd) {
 	perror("open");
-	return -1;
     }
+    return file_fd;
+}
 
-    seekto.write_cmd = write_cmd;
-    seekto.write_cmd_offset = write_cmd_offset;
-    ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto);
-
-    while ((bytes_read = read(file_fd, buf, SOCK_READ_BUF_SIZE))) {
-	if (-1 == bytes_read) {
-	    perror("read");
-	    return (-1);
-	}
-	PRINTF("bytes_read = %d\n",bytes_read);
-	// Ignore partial writes.  Shouldn't happen...
-	if (write(conn_fd, buf, bytes_read) != bytes_read) {
-	    perror("write");
-	    return (-1);
-	}
+// Delete the data file on the way out, if it's one we created.
+void datafile_remove(struct datafile *p_datafile)
+{
+    if (p_datafile->remove_on_exit) {
+	unlink(p_datafile->name);
     }
+}
 
-    if (-1 == close(file_fd)) {
+// Release a descriptor from datafile_get_fd().
+void datafile_put_fd(struct datafile *p_datafile, int file_fd)
+{
+    if (p_datafile->reopen && (-1 == close(file_fd))) {
 	perror("close");
-	return (-1);
     }
-
-    return 0;
 }
 
-// Server thread to handle a single connection from a client.
-// Must free any resources allocated in the thread (ie malloc buffer).
-// Connection socket, etc allocated in main are cleaned up in main
-// thread after server thread exits.
-void *server_thread(void *arg)
+// Append the iovcnt buffers in iov to the data file in a single
+// writev().  Must be called with the data file lock held exclusively.
+// The regular file is written at the size tracked here rather than with
+// O_APPEND, so an append can reserve its range under the lock and
+// complete after it's dropped (uring mode) without anything else
+// landing on top of it.  Returns 0 on success, -1 on error.
+int datafile_appendv(struct datafile *p_datafile, const struct iovec *iov,
+		     int iovcnt)
 {
-    struct server_thread_data *p_thread_data = (struct server_thread_data *)arg;
-    sigset_t signal_set;
-    char *buf_start, *buf_curr;
-    int cur_buf_size;
-    int bytes_read;
-    char *newline_ptr;
-    uint32_t write_cmd, write_cmd_offset;
+    ssize_t bytes_written;
+    int file_fd;
 
-    // Block SIGINT and SIGTERM - let main thread handle them.
-    sigemptyset(&signal_set);
-    sigaddset(&signal_set, SIGINT);
-    sigaddset(&signal_set, SIGTERM);
-    if (pthread_sigmask(SIG_BLOCK, &signal_set, NULL)) {
-	perror("pthread_sigmask");
-	pthread_exit(p_thread_data);
+    if (-1 == (file_fd = datafile_get_fd(p_datafile))) {
+	return -1;
     }
 
-    // Allocate an initial buffer.  buf_start is the original
-    // buffer returned by malloc and used for realloc/free.
-    // buf_curr is the current recv pointer, used by recv.
-    cur_buf_size = SOCK_READ_BUF_SIZE;
-    if (!(buf_curr = (buf_start = malloc(cur_buf_size)))) {
-	perror("malloc");
-	pthread_exit(p_thread_data);
+    // Ignore partial writes (fs full)
+    if (p_datafile->is_regular) {
+	bytes_written = pwritev(file_fd, iov, iovcnt, p_datafile->size);
+    } else {
+	bytes_written = writev(file_fd, iov, iovcnt);
+    }
+    if (-1 == bytes_written) {
+	perror("writev");
+	datafile_put_fd(p_datafile, file_fd);
+	return -1;
+    }
+    // Past a uring append still in flight, it isn't readable yet
+    if (p_datafile->committed == p_datafile->size) {
+	p_datafile->committed += bytes_written;
     }
+    p_datafile->size += bytes_written;
 
-    while (!p_thread_data->client_done) {
-	bytes_read = recv(p_thread_data->conn_fd, buf_curr, SOCK_READ_BUF_SIZE, 0);
-	if (-1 >= bytes_read) {
-	    // -1 on error
-	    perror("recv");
-	    free(buf_start);
-	    pthread_exit(p_thread_data);
-	} else if (0 == bytes_read) {
-	    // 0 on remote connection closed
-	    p_thread_data->client_done = 1;
-	    free(buf_start);
-	    PRINTF("Closed connection from %s:%s\n", p_thread_data->client_ip_addr_str, p_thread_data->client_port_str);
-	    syslog(LOG_USER|LOG_INFO, "Closed connection from %s",
-		   p_thread_data->client_ip_addr_str);
-	    pthread_exit(p_thread_data);
-	} else if (SOCK_READ_BUF_SIZE == bytes_read) {
-	    // If the recv filled the buffer, there may be more data
-	    // waiting.  Enlarge the buffer and read some more.
-	    cur_buf_size += SOCK_READ_BUF_SIZE;
-	    if (!(buf_start = realloc(buf_start, cur_buf_size))) {
-		perror("realloc");
-		// Realloc free'd old buffer, nothing to free now
-		pthread_exit(p_thread_data);
-	    }
-	    // Realloc can move the buffer.  Calculate new read
-	    // destination as new buffer start plus current size,
-	    // then back up one read block size.
-	    buf_curr = buf_start + cur_buf_size - SOCK_READ_BUF_SIZE;
-	} else {
-	    // Read < SOCK_READ_BUF_SIZE and > 0.  We've read all
-	    // of the client data.  Null terminate the string,
-	    // write to the output file, and return the whole file
-	    buf_curr[bytes_read] = 0;
-	    PRINTF("length = %ld\n",strlen(buf_start));
-	    // Find the first newline, start at byte 0.  If no newline,
-	    // use the null at the end.
-	    newline_ptr = strchrnul(buf_start,'\n');
-	    PRINTF("strchr found newline at offset %ld\n", newline_ptr -
-		   buf_start);
-
-	    // Lock mutex around file i/o - can we unlock before read?
-	    if (pthread_mutex_lock(p_thread_data->p_file_mutex)) {
-		perror("pthread_mutex_lock");
-		free(buf_start);
-		pthread_exit(p_thread_data);
-	    }
-	    
-	    // Check for inline seekto command.  Issue ioctl if found
-	    // (without writing string to file).  If not found, write
-	    // string as normal.
-	    if (!strncmp(IOCSEEKTO_CMD_STR, buf_start,
-			 IOCSEEKTO_CMD_STRLEN)) {
-		// Inline seekto, don't write to file
-		sscanf(buf_start, IOCSEEKTO_CMD_STR, &write_cmd,
-		       &write_cmd_offset);
-	    } else {
-		// Regular data, write it.
-		write_cmd = 0;
-		write_cmd_offset = 0;
-		if (write_data_to_file(buf_start,
-				       newline_ptr - buf_start)) {
-		    (void) pthread_mutex_unlock(p_thread_data->p_file_mutex);
-		    free(buf_start);
-		    pthread_exit(p_thread_data);
-		}
-	    }
+    datafile_put_fd(p_datafile, file_fd);
+    return 0;
+}
 
-	    if (send_data_file_to_client(p_thread_data->conn_fd, buf_start,
-					 write_cmd, write_cmd_offset)) {
-		(void) pthread_mutex_unlock(p_thread_data->p_file_mutex);
-		free(buf_start);
-		pthread_exit(p_thread_data);
-	    }
+// Append size bytes of buf to the data file, plus a trailing newline if
+// add_newline is set.  Must be called with the data file lock held
+// exclusively.  Returns 0 on success, -1 on error.
+int datafile_append(struct datafile *p_datafile, const char *buf,
+		    size_t size, int add_newline)
+{
+    struct iovec iov[2];
 
-	    // Unlock mutex around file i/o - can we unlock before read?
-	    if (pthread_mutex_unlock(p_thread_data->p_file_mutex)) {
-		perror("pthread_mutex_unlock");
-		free(buf_start);
-		pthread_exit(p_thread_data);
-	    }
+    // Write up to (but NOT including) the newline, then the newline
+    // from a static string - the packet may not have had one.
+    iov[0].iov_base = (void *) buf;
+    iov[0].iov_len = size;
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    return datafile_appendv(p_datafile, iov, add_newline ? 2 : 1);
+}
 
-	    // Now read the entire file and send it back to the client
-	    //
-	    // Reset the buffer size and pointers
-	    cur_buf_size = SOCK_READ_BUF_SIZE;
-	    if (!(buf_curr = (buf_start = realloc(buf_start,
-						  cur_buf_size)))) {
-		perror("realloc");
-		pthread_exit(p_thread_data);
-	    }
-	}
+// Work out what kind of packet pkt is and fill in *p_cmd.  pkt must be
+// NUL terminated somewhere after the command arguments.
+void parse_packet(const char *pkt, struct packet_cmd *p_cmd)
+{
+    bzero(p_cmd, sizeof(struct packet_cmd));
+    if (!strncmp(IOCSEEKTO_CMD_STR, pkt, IOCSEEKTO_CMD_STRLEN)) {
+	p_cmd->type = PACKET_SEEKTO;
+	sscanf(pkt, IOCSEEKTO_CMD_STR, &p_cmd->write_cmd,
+	       &p_cmd->write_cmd_offset);
+    } else if (!strncmp(DELTA_CMD_STR, pkt, DELTA_CMD_STRLEN)) {
+	p_cmd->type = PACKET_DELTA;
+	sscanf(pkt, DELTA_CMD_STR, &p_cmd->delta_on);
+    } else if (!strncmp(STATS_CMD_STR, pkt, STATS_CMD_STRLEN)) {
+	p_cmd->type = PACKET_STATS;
+    } else {
+	p_cmd->type = PACKET_DATA;
     }
-    // Don't really care about return, since we save the ptr in an SLIST
-    return arg;
 }
 
-// Append a timestamp to the output file every TIMESTAMP_DELAY_SECS
-// Re-use the server thread's struct thread_data, since it has the
+// Work out the byte range [*p_start, *p_end) of file_fd to send back
+// to the client for the packet described by p_cmd, and update the
+// client's session.  Must be called with the data file lock held.
 //
-// Must free any resources allocated in the thread (ie malloc buffer).
-// Connection socket, etc allocated in main are cleaned up in main
-// thread after server thread exits.
-#ifndef USE_AESD_CHAR_DEVICE
-void *timestamp_thread(void *arg)
+// For a regular file the range is the whole file, tracked in size.  The
+// char device applies a seekto command to find the start, and the end
+// is the current size of the device.  In delta mode the start moves up
+// to where the client's previous reply ended, so each reply only has
+// new data.  Char device offsets shift whenever the driver drops its
+// oldest entries, so there the cursor is kept as a stream offset
+// (AESDCHAR_IOCGWINDOW) and the client gets whatever is still held past
+// it.  A driver without the window ioctl always gets the full contents.
+// Returns 0 on success, -1 on error.
+int datafile_reply_range(struct datafile *p_datafile, int file_fd,
+			 const struct packet_cmd *p_cmd,
+			 struct client_session *p_session, off_t *p_start,
+			 off_t *p_end)
 {
-    struct timestamp_thread_data *p_thread_data =
-	(struct timestamp_thread_data *) arg;
-    struct timespec ts;
-    struct tm tm;
-    char timestr[TIME_MAX_STRLEN];
-    size_t timelen;
-    int file_fd;
-
-    while (1) {
-	// Returns a pointer to the supplied struct timespec,
-	// ts.tv_sec is clock time in sec since epoch
-	if (clock_gettime(CLOCK_REALTIME, &ts)) {
-	    perror("clock_gettime");
-	    pthread_exit(p_thread_data);
-	}
+    struct aesd_seekto seekto_arg;
+    struct aesd_window window;
 
-	// Returns a pointer to the supplied struct timespec
-	(void) gmtime_r(&(ts.tv_sec), &tm);
-
-	timelen = TIME_MAX_STRLEN;
-	timelen = strftime(timestr, timelen,
-			   "timestamp:%Y-%m-%d %H:%M:%S%n", &tm);
+    if (PACKET_DELTA == p_cmd->type) {
+	// Reply to the switch with everything, the cursor starts at 0
+	p_session->delta_mode = p_cmd->delta_on;
+	p_session->delta_cursor = 0;
+    }
 
-	// Lock mutex around file i/o - can we unlock before read?
-	if (pthread_mutex_lock(p_thread_data->p_file_mutex)) {
-	    perror("pthread_mutex_lock");
-	    pthread_exit(p_thread_data);
+    *p_start = 0;
+    if (p_datafile->is_regular) {
+	// A data packet's reply ends with the packet, even if more has
+	// been appended since
+	*p_end = (PACKET_DATA == p_cmd->type) ? p_cmd->append_end :
+	    p_datafile->committed;
+	if (p_session->delta_mode) {
+	    if (p_session->delta_cursor < *p_end) {
+		*p_start = p_session->delta_cursor;
+	    } else {
+		*p_start = *p_end;
+	    }
+	    p_session->delta_cursor = *p_end;
 	}
+	return 0;
+    }
 
-	if (-1 == (file_fd = open(DATAFILE_NAME, DATAFILE_FLAGS,
-				  DATAFILE_MODE))) {
-	    perror("open");
-	    // Things are already broken. Ignore return of unlock
-	    (void) pthread_mutex_unlock(p_thread_data->p_file_mutex);
-	    pthread_exit(p_thread_data);
+    // Bad seekto arguments just leave the reply starting at 0
+    seekto_arg.write_cmd = p_cmd->write_cmd;
+    seekto_arg.write_cmd_offset = p_cmd->write_cmd_offset;
+    if ((PACKET_SEEKTO == p_cmd->type) &&
+	!ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seekto_arg)) {
+	if (-1 == (*p_start = lseek(file_fd, 0, SEEK_CUR))) {
+	    perror("lseek");
+	    return -1;
 	}
-
-	if (-1 == write(file_fd, timestr, timelen)) {
-	    perror("write");
-	    (void) pthread_mutex_unlock(p_thread_data->p_file_mutex);
-	    pthread_exit(p_thread_data);
+    }
+    if (-1 == (*p_end = lseek(file_fd, 0, SEEK_END))) {
+	perror("lseek");
+	return -1;
+    }
+    // Offsets of file_fd count from window.base, the oldest byte held
+    if (p_session->delta_mode &&
+	!ioctl(file_fd, AESDCHAR_IOCGWINDOW, &window)) {
+	if ((off_t) window.base + *p_start < p_session->delta_cursor) {
+	    *p_start = (p_session->delta_cursor < (off_t) window.end) ?
+		p_session->delta_cursor - (off_t) window.base : *p_end;
 	}
+	p_session->delta_cursor = window.base + *p_end;
+    }
+    return 0;
+}
 
-	if (-1 == close(file_fd)) {
-	    perror("close");
-	    (void) pthread_mutex_unlock(p_thread_data->p_file_mutex);
-	    pthread_exit(p_thread_data);
-	}
+// Read bytes [start, end) of file_fd into a malloc'd buffer returned
+// in *p_buf, with the number of bytes read in *p_len (short if the file
+// ended early).  Caller must free *p_buf.
+int read_data_range(int file_fd, off_t start, off_t end, char **p_buf,
+		    size_t *p_len)
+{
+    char *buf;
+    size_t len;
+    ssize_t bytes_read;
 
-	// Unlock mutex around file i/o - can we unlock before read?
-	if (pthread_mutex_unlock(p_thread_data->p_file_mutex)) {
-	    perror("pthread_mutex_unlock");
-	    pthread_exit(p_thread_data);
+    // malloc(0) may return NULL, always ask for at least a byte
+    if (!(buf = malloc((end > start) ? end - start : 1))) {
+	perror("malloc");
+	return -1;
+    }
+    for (len = 0; start + (off_t) len < end; len += bytes_read) {
+	bytes_read = pread(file_fd, buf + len, end - start - len, start + len);
+	if (-1 == bytes_read) {
+	    perror("pread");
+	    free(buf);
+	    return -1;
+	} else if (0 == bytes_read) {
+	    break;
 	}
-	PRINTF("TICK!\n");
-	sleep(TIMESTAMP_DELAY_SECS);
     }
-    return p_thread_data;
+
+    *p_buf = buf;
+    *p_len = len;
+    return 0;
 }
-#endif // USE_AESD_CHAR_DEVICE
 
-int main(int argc, char *argv[])
+// Initialize an empty reply.
+void reply_init(struct reply *p_reply)
 {
-    int sock_fd=0, conn_fd=0;
-    int arg, daemonize;
-    pthread_mutex_t datafile_mutex;
-    SLIST_HEAD(slisthead, server_thread_data) thread_list_head;
-#ifndef USE_AESD_CHAR_DEVICE
-    struct timestamp_thread_data *p_timestamp_thread_data;
-#endif // USE_AESD_CHAR_DEVICE
-    struct server_thread_data *p_server_thread_data=NULL;
-    char client_ip_addr_str[IP_ADDR_MAX_STRLEN];
-    char client_port_str[IP_ADDR_MAX_STRLEN];
-    int exit_status = EXIT_FAILURE; // Fail by default
+    bzero(p_reply, sizeof(struct reply));
+    p_reply->fd = -1;
+}
+
+// True if p_reply has data that hasn't been completely sent yet.
+int reply_pending(struct reply *p_reply)
+{
+    return (NULL != p_reply->buf) || (-1 != p_reply->fd) ||
+	(NULL != p_reply->pipe_fds);
+}
+
+// Count a reply that has been completely sent in the statistics.
+void stats_reply_done(struct reply *p_reply)
+{
+    long long latency_us;
+    int bucket;
+
+    STATS_ADD(replies_out, 1);
+    if (!p_reply->start_ns) {
+	return;
+    }
+    latency_us = (monotonic_ns() - p_reply->start_ns) / 1000;
+    for (bucket = 0; (bucket < STATS_LATENCY_BUCKETS - 1) &&
+	     (latency_us >> (bucket + 1)); bucket++)
+	;
+    STATS_ADD(reply_latency_us[bucket], 1);
+    p_reply->start_ns = 0;
+}
+
+// Format the statistics as one line of JSON in a malloc'd reply.  Must
+// be called with the data file lock held, for the storage size.
+// Returns 0 on success, -1 on error.
+int stats_capture_reply(struct datafile *p_datafile, int file_fd,
+			struct reply *p_reply)
+{
+    unsigned long accepted, closed;
+    off_t size;
+    char *buf;
+    int len, i;
+
+    if (p_datafile->is_regular) {
+	size = p_datafile->committed;
+    } else if (-1 == (size = lseek(file_fd, 0, SEEK_END))) {
+	perror("lseek");
+	return -1;
+    }
+    if (!(buf = malloc(STATS_MAX_STRLEN))) {
+	perror("malloc");
+	return -1;
+    }
+
+    // Read closed first so active can't go negative
+    closed = STATS_GET(conns_closed);
+    accepted = STATS_GET(conns_accepted);
+    len = snprintf(buf, STATS_MAX_STRLEN,
+		   "{\"connections_active\": %lu, "
+		   "\"connections_accepted\": %lu, "
+		   "\"connections_closed\": %lu, "
+		   "\"connections_rejected\": %lu, "
+		   "\"packets_in\": %lu, \"bytes_in\": %lu, "
+		   "\"replies_out\": %lu, \"bytes_out\": %lu, "
+		   "\"lock_acquires\": %lu, \"lock_wait_ns\": %lu, "
+		   "\"storage_bytes\": %lld, \"reply_latency_us_log2\": [",
+		   accepted - closed, accepted, closed,
+		   STATS_GET(conns_rejected),
+		   STATS_GET(packets_in), STATS_GET(bytes_in),
+		   STATS_GET(replies_out), STATS_GET(bytes_out),
+		   STATS_GET(lock_acquires), STATS_GET(lock_wait_ns),
+		   (long long) size);
+    for (i = 0; i < STATS_LATENCY_BUCKETS; i++) {
+	len += snprintf(buf + len, STATS_MAX_STRLEN - len, "%s%lu",
+			i ? ", " : "", STATS_GET(reply_latency_us[i]));
+    }
+    len += snprintf(buf + len, STATS_MAX_STRLEN - len, "]}\n");
+
+    p_reply->buf = buf;
+    p_reply->len = len;
+    p_reply->sent = 0;
+    return 0;
+}
+
+// Release everything held by p_reply and make it empty.  p_datafile may
+// be NULL if the reply doesn't hold a data file descriptor.
+void reply_free(struct datafile *p_datafile, struct reply *p_reply)
+{
+    free(p_reply->buf);
+    if (-1 != p_reply->fd) {
+	datafile_put_fd(p_datafile, p_reply->fd);
+    }
+    // Unsent bytes would go out as part of the next reply; close the
+    // pipe instead, the session makes a new one when it needs it.
+    if (p_reply->pipe_fds && p_reply->pipe_len &&
+	(-1 != p_reply->pipe_fds[0])) {
+	close(p_reply->pipe_fds[0]);
+	close(p_reply->pipe_fds[1]);
+	p_reply->pipe_fds[0] = p_reply->pipe_fds[1] = -1;
+    }
+    reply_init(p_reply);
+}
+
+// Release what a connection's session holds when it closes, and reset
+// it for the next connection (pool threads reuse theirs).
+void session_free(struct client_session *p_session)
+{
+    if (p_session->pipe_open && (-1 != p_session->pipe_fds[0])) {
+	close(p_session->pipe_fds[0]);
+	close(p_session->pipe_fds[1]);
+    }
+    bzero(p_session, sizeof(struct client_session));
+}
+
+// Snapshot bytes [*p_start, end) of the char device into the session's
+// pipe, behind any earlier replies of the batch still waiting there,
+// without copying through user space, so the reply can be spliced out to
+// the client after the lock is dropped.  The pipe is made once per
+// connection and grown as needed, up to SNAPSHOT_PIPE_MAX.  *p_start
+// is advanced past what made it into the pipe.  Returns 0 once it all
+// has, -1 on error with errno EINVAL/ENOSYS if the device can't splice,
+// or EFBIG if the rest won't fit in the pipe.
+int snapshot_to_pipe(struct client_session *p_session, int file_fd,
+		     off_t *p_start, off_t end, struct reply *p_reply)
+{
+    ssize_t bytes_in;
+    int pipe_size, queued;
+    off_t needed;
+
+    if (!p_session->pipe_open || (-1 == p_session->pipe_fds[0])) {
+	if (pipe2(p_session->pipe_fds, O_CLOEXEC | O_NONBLOCK)) {
+	    perror("pipe2");
+	    p_session->pipe_open = 0;
+	    return -1;
+	}
+	p_session->pipe_open = 1;
+    }
+    // Grow the pipe if needed.  Fails past /proc/sys/fs/pipe-max-size.
+    if (ioctl(p_session->pipe_fds[0], FIONREAD, &queued) ||
+	(-1 == (pipe_size = fcntl(p_session->pipe_fds[1], F_GETPIPE_SZ)))) {
+	perror("pipe size");
+	return -1;
+    }
+    needed = queued + (end - *p_start);
+    if ((pipe_size < needed) &&
+	((needed > SNAPSHOT_PIPE_MAX) ||
+	 (fcntl(p_session->pipe_fds[1], F_SETPIPE_SZ, (int) needed) < 0))) {
+	errno = EFBIG;
+	return -1;
+    }
+
+    p_reply->pipe_fds = p_session->pipe_fds;
+    p_reply->pipe_len = 0;
+    while (*p_start < end) {
+	bytes_in = splice(file_fd, p_start, p_session->pipe_fds[1], NULL,
+			  end - *p_start, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (-1 == bytes_in) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    if (EAGAIN == errno) {
+		errno = EFBIG;
+	    }
+	    if (!p_reply->pipe_len) {
+		p_reply->pipe_fds = NULL;
+	    }
+	    return -1;
+	} else if (0 == bytes_in) {
+	    break;
+	}
+	p_reply->pipe_len += bytes_in;
+    }
+    return 0;
+}
+
+// Capture the reply for bytes [start, end) of the data file.  Must be
+// called with the data file lock held.  The regular data file is append
+// only, so bytes below size never change and the reply is just the
+// range, streamed from file_fd later.  The char device drops entries,
+// so its contents are snapshotted now; into p_session's pipe with
+// splice() if the driver supports it, and into memory past what fits.
+// file_fd is owned by the reply (or released) when this returns 0.
+int capture_reply(struct datafile *p_datafile,
+		  struct client_session *p_session, int file_fd, off_t start,
+		  off_t end, struct reply *p_reply)
+{
+    if (p_datafile->is_regular) {
+	p_reply->fd = file_fd;
+	p_reply->offset = start;
+	p_reply->end = end;
+	return 0;
+    }
+
+    if (!__atomic_load_n(&p_datafile->splice_unsupported, __ATOMIC_RELAXED)) {
+	if (!snapshot_to_pipe(p_session, file_fd, &start, end, p_reply)) {
+	    datafile_put_fd(p_datafile, file_fd);
+	    return 0;
+	} else if ((EINVAL == errno) || (ENOSYS == errno)) {
+	    PRINTF("splice not supported, falling back to read\n");
+	    __atomic_store_n(&p_datafile->splice_unsupported, 1,
+			     __ATOMIC_RELAXED);
+	}
+	// EFBIG: the rest doesn't fit in the pipe, fall through to a
+	// memory snapshot of it
+    }
+
+    if (read_data_range(file_fd, start, end, &p_reply->buf, &p_reply->len)) {
+	datafile_put_fd(p_datafile, file_fd);
+	return -1;
+    }
+    p_reply->sent = 0;
+    datafile_put_fd(p_datafile, file_fd);
+    return 0;
+}
+
+// Send as much of p_reply to the client as the socket will take.  On a
+// blocking socket that's all of it; on a non-blocking one, stop when
+// the socket is full.  Ranges of the regular data file go out with
+// sendfile() (or are read into memory and sent from there if sendfile
+// isn't supported), char device snapshots are spliced out of their
+// pipe.  Returns 0 on success, check reply_pending() for completion,
+// or -1 on error.
+int reply_send(struct datafile *p_datafile, int conn_fd,
+	       struct reply *p_reply)
+{
+    ssize_t bytes_sent;
+
+    while (-1 != p_reply->fd) {
+	if (p_reply->offset >= p_reply->end) {
+	    datafile_put_fd(p_datafile, p_reply->fd);
+	    p_reply->fd = -1;
+	    break;
+	}
+	if (__atomic_load_n(&p_datafile->sendfile_unsupported,
+			    __ATOMIC_RELAXED)) {
+	    bytes_sent = -1;
+	    errno = EINVAL;
+	} else {
+	    bytes_sent = sendfile(conn_fd, p_reply->fd, &p_reply->offset,
+				  p_reply->end - p_reply->offset);
+	}
+	if (bytes_sent > 0) {
+	    STATS_ADD(bytes_out, bytes_sent);
+	}
+	if (-1 == bytes_sent) {
+	    if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+		return 0;
+	    } else if (EINTR == errno) {
+		continue;
+	    } else if ((EINVAL != errno) && (ENOSYS != errno)) {
+		perror("sendfile");
+		return -1;
+	    }
+	    // The rest of the range can't change, read it in and send
+	    // it the slow way.
+	    PRINTF("sendfile not supported, falling back to send\n");
+	    __atomic_store_n(&p_datafile->sendfile_unsupported, 1,
+			     __ATOMIC_RELAXED);
+	    if (read_data_range(p_reply->fd, p_reply->offset, p_reply->end,
+				&p_reply->buf, &p_reply->len)) {
+		return -1;
+	    }
+	    p_reply->sent = 0;
+	    datafile_put_fd(p_datafile, p_reply->fd);
+	    p_reply->fd = -1;
+	} else if (0 == bytes_sent) {
+	    // File is shorter than expected, nothing more to send
+	    p_reply->offset = p_reply->end;
+	}
+    }
+
+    while (p_reply->pipe_fds) {
+	if (!p_reply->pipe_len) {
+	    // The pipe is the session's, left open for the next reply
+	    p_reply->pipe_fds = NULL;
+	    break;
+	}
+	bytes_sent = splice(p_reply->pipe_fds[0], NULL, conn_fd, NULL,
+			    p_reply->pipe_len, SPLICE_F_MOVE);
+	if (-1 == bytes_sent) {
+	    if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+		return 0;
+	    } else if (EINTR == errno) {
+		continue;
+	    }
+	    perror("splice");
+	    return -1;
+	}
+	p_reply->pipe_len -= bytes_sent;
+	STATS_ADD(bytes_out, bytes_sent);
+    }
+
+    while (p_reply->buf) {
+	if (p_reply->sent == p_reply->len) {
+	    free(p_reply->buf);
+	    p_reply->buf = NULL;
+	    break;
+	}
+	bytes_sent = send(conn_fd, p_reply->buf + p_reply->sent,
+			  p_reply->len - p_reply->sent, MSG_NOSIGNAL);
+	if (-1 == bytes_sent) {
+	    if ((EAGAIN == errno) || (EWOULDBLOCK == errno)) {
+		return 0;
+	    } else if (EINTR == errno) {
+		continue;
+	    }
+	    perror("send");
+	    return -1;
+	}
+	p_reply->sent += bytes_sent;
+	STATS_ADD(bytes_out, bytes_sent);
+    }
+    stats_reply_done(p_reply);
+    return 0;
+}
+
+// Take the data file lock, exclusive or shared, counting the time spent
+// waiting for it.  Returns 0 on success, -1 on error.
+int datafile_rwlock(struct datafile *p_datafile, int exclusive)
+{
+    long long start_ns;
+    int lock_status;
+
+    start_ns = monotonic_ns();
+    if (exclusive) {
+	lock_status = pthread_rwlock_wrlock(&p_datafile->lock);
+    } else {
+	lock_status = pthread_rwlock_rdlock(&p_datafile->lock);
+    }
+    if (lock_status) {
+	errno = lock_status;
+	perror("pthread_rwlock_lock");
+	return -1;
+    }
+    STATS_ADD(lock_acquires, 1);
+    STATS_ADD(lock_wait_ns, monotonic_ns() - start_ns);
+    return 0;
+}
+
+// True if the packet described by p_cmd needs the data file lock
+// exclusively.  Appends and the char device seekto (which moves the
+// shared file position) do.  Other commands only read, so they share it.
+int packet_needs_exclusive(struct datafile *p_datafile,
+			   const struct packet_cmd *p_cmd)
+{
+    return (PACKET_DATA == p_cmd->type) ||
+	((PACKET_SEEKTO == p_cmd->type) && !p_datafile->is_regular);
+}
+
+// Lock the data file for the packet described by p_cmd.  Returns 0 on
+// success, -1 on error.
+int datafile_lock(struct datafile *p_datafile, const struct packet_cmd *p_cmd)
+{
+    return datafile_rwlock(p_datafile,
+			   packet_needs_exclusive(p_datafile, p_cmd));
+}
+
+// Set up the timestamp timer to append a record to the data file every
+// interval_ms, 0 = never.  It's a CLOCK_MONOTONIC timerfd with a fixed
+// period, so records don't drift by however long each append takes,
+// and there's no thread behind it: whichever loop the mode runs polls
+// timer_fd and calls timestamp_timer_fire() when it's readable.
+// Returns 0 on success, -1 on error.
+int init_timestamp_timer(struct datafile *p_datafile, long interval_ms)
+{
+    struct itimerspec period;
+
+    timestamp_timer.p_datafile = p_datafile;
+    timestamp_timer.interval_ms = interval_ms;
+    if (interval_ms <= 0) {
+	return 0;
+    }
+    if (-1 == (timestamp_timer.timer_fd =
+	       timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))) {
+	perror("timerfd_create");
+	return -1;
+    }
+    period.it_interval.tv_sec = interval_ms / 1000;
+    period.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    period.it_value = period.it_interval;
+    if (timerfd_settime(timestamp_timer.timer_fd, 0, &period, NULL)) {
+	perror("timerfd_settime");
+	close(timestamp_timer.timer_fd);
+	timestamp_timer.timer_fd = -1;
+	return -1;
+    }
+    return 0;
+}
+
+// Append a timestamp record for the current time to the data file.
+// Intervals that aren't whole seconds get milliseconds too, so every
+// record is distinct.  Returns 0 on success, -1 on error.
+int timestamp_append()
+{
+    struct datafile *p_datafile = timestamp_timer.p_datafile;
+    struct timespec ts;
+    struct tm tm;
+    char timestr[TIME_MAX_STRLEN];
+    size_t timelen;
+    int status;
+
+    // ts.tv_sec is clock time in sec since epoch
+    if (clock_gettime(CLOCK_REALTIME, &ts)) {
+	perror("clock_gettime");
+	return -1;
+    }
+    (void) gmtime_r(&(ts.tv_sec), &tm);
+    timelen = strftime(timestr, TIME_MAX_STRLEN,
+		       "timestamp:%Y-%m-%d %H:%M:%S", &tm);
+    if (timestamp_timer.interval_ms % 1000) {
+	timelen += snprintf(timestr + timelen, TIME_MAX_STRLEN - timelen,
+			    ".%03ld", ts.tv_nsec / 1000000);
+    }
+
+    // Only the append itself is under the lock
+    if (datafile_rwlock(p_datafile, 1)) {
+	return -1;
+    }
+    status = datafile_append(p_datafile, timestr, timelen, 1);
+    if (pthread_rwlock_unlock(&p_datafile->lock)) {
+	perror("pthread_rwlock_unlock");
+	return -1;
+    }
+    PRINTF("TICK!\n");
+    return status;
+}
+
+// Handle the timestamp timer becoming readable.  Periods missed while
+// the loop was busy are folded into one record rather than written
+// back to back.  Returns 0 on success (or a spurious wakeup), -1 on
+// error.
+int timestamp_timer_fire()
+{
+    uint64_t expirations;
+
+    if (-1 == read(timestamp_timer.timer_fd, &expirations,
+		   sizeof(expirations))) {
+	if (EAGAIN == errno) {
+	    return 0;
+	}
+	perror("read timerfd");
+	return -1;
+    }
+    if (expirations > 1) {
+	PRINTF("Missed %llu timestamps\n",
+	       (unsigned long long) (expirations - 1));
+    }
+    return timestamp_append();
+}
+
+// Wait for fd to become readable, firing the timestamp timer whenever
+// it expires in the meantime.  Returns 0 once fd is readable, -1 with
+// errno set on error (EINTR once SIGINT or SIGTERM is pending).  The
+// signal is left on signal_fd, so every thread waiting here sees it.
+int wait_readable(int fd)
+{
+    struct pollfd fds[3];
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = timestamp_timer.timer_fd;	// poll() ignores -1
+    fds[1].events = POLLIN;
+    fds[2].fd = signal_fd;
+    fds[2].events = POLLIN;
+    while (1) {
+	if (-1 == poll(fds, 3, -1)) {
+	    return -1;
+	}
+	if (fds[2].revents & POLLIN) {
+	    errno = EINTR;
+	    return -1;
+	}
+	if (fds[1].revents & POLLIN) {
+	    (void) timestamp_timer_fire();
+	}
+	if (fds[0].revents) {
+	    return 0;
+	}
+    }
+}
+
+// Limit on connections being served at once (-c), 0 = no limit.  main
+// takes a slot before each accept and the connection gives it back when
+// it closes, so past the limit new clients wait in the listen backlog.
+// The free slots are the count of an EFD_SEMAPHORE eventfd, so main
+// can wait for one in poll() alongside the timestamp timer.
+int init_conn_slots(int max_connections)
+{
+    if (!max_connections) {
+	return 0;
+    }
+    if (-1 == (conn_slots_fd = eventfd(max_connections, EFD_SEMAPHORE |
+				       EFD_NONBLOCK | EFD_CLOEXEC))) {
+	perror("eventfd");
+	return -1;
+    }
+    return 0;
+}
+
+// Take a free connection slot if there is one.  Returns 0 on success,
+// -1 with errno EAGAIN if they're all in use.
+int conn_slot_try_acquire()
+{
+    uint64_t slot;
+
+    if ((-1 == conn_slots_fd) ||
+	(sizeof(slot) == read(conn_slots_fd, &slot, sizeof(slot)))) {
+	return 0;
+    }
+    return -1;
+}
+
+// Wait for a free connection slot.  Returns 0 on success, -1 with
+// errno EINTR if interrupted by a signal.
+int conn_slot_acquire()
+{
+    while (conn_slot_try_acquire()) {
+	if ((EAGAIN != errno) || wait_readable(conn_slots_fd)) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// Give back a connection slot.
+void conn_slot_release()
+{
+    uint64_t slot = 1;
+
+    if ((-1 != conn_slots_fd) &&
+	(-1 == write(conn_slots_fd, &slot, sizeof(slot)))) {
+	perror("write eventfd");
+    }
+}
+
+// Wait for connection from client.  Returns a new fd that client data can be
+// read from, or -1 on error (after perror) or, with errno EINTR, once
+// SIGINT or SIGTERM is pending.
+int wait_for_client_connection(int sock_fd, char *client_ip_addr_str,
+			       char *client_port_str)
+{
+    int conn_fd;
+
+    // Wait for a connection slot (see init_conn_slots()), then for a
+    // client, keeping the timestamp timer going meanwhile.
+    if (conn_slot_acquire()) {
+	if (EINTR != errno) {
+	    perror("read eventfd");
+	}
+	return -1;
+    }
+    if (wait_readable(sock_fd) ||
+	(-1 == (conn_fd = accept_client(sock_fd, client_ip_addr_str,
+					client_port_str)))) {
+	if (EINTR != errno) {
+	    perror("accept");
+	}
+	conn_slot_release();
+	return -1;
+    }
+    return(conn_fd);
+}
+
+// With the server threads accepting for themselves (-P), main only has
+// the timestamp timer to run.  Returns 0 once SIGINT or SIGTERM is
+// pending, -1 on error.
+int wait_for_signal()
+{
+    // poll() ignores the -1, so this only returns on a signal or error
+    if (wait_readable(-1) && (EINTR != errno)) {
+	perror("poll");
+	return -1;
+    }
+    return 0;
+}
+
+// Capture the reply to the packet described by p_cmd, once any append
+// for it is in the data file.  Must be called with the data file lock
+// held.  Returns 0 on success, -1 on error.
+int packet_capture_reply(struct datafile *p_datafile,
+			 struct client_session *p_session,
+			 const struct packet_cmd *p_cmd, struct reply *p_reply)
+{
+    off_t start, end;
+    int file_fd, retval;
+
+    if (-1 == (file_fd = datafile_get_fd(p_datafile))) {
+	return -1;
+    }
+    if (PACKET_STATS == p_cmd->type) {
+	retval = stats_capture_reply(p_datafile, file_fd, p_reply);
+	datafile_put_fd(p_datafile, file_fd);
+	return retval;
+    }
+    if (datafile_reply_range(p_datafile, file_fd, p_cmd, p_session, &start,
+			     &end)) {
+	datafile_put_fd(p_datafile, file_fd);
+	return -1;
+    }
+    return capture_reply(p_datafile, p_session, file_fd, start, end, p_reply);
+}
+
+// Set up an empty framer with a buf_size byte buffer.  Returns 0 on
+// success, -1 on error.
+int framer_init(struct packet_framer *p_framer, size_t max_packet_size,
+		size_t buf_size)
+{
+    bzero(p_framer, sizeof(struct packet_framer));
+    p_framer->max_packet_size = max_packet_size;
+    p_framer->min_size = p_framer->size = buf_size;
+    if (!(p_framer->buf = malloc(p_framer->size))) {
+	perror("malloc");
+	return -1;
+    }
+    return 0;
+}
+
+// Free the framer's buffer.
+void framer_free(struct packet_framer *p_framer)
+{
+    free(p_framer->buf);
+    p_framer->buf = NULL;
+}
+
+// Get the free space at the end of the buffer to recv() into, at least
+// one byte.  *p_space is set to its size.  Makes room by sliding the
+// partial packet down to the start of the buffer, then by doubling the
+// buffer, so a packet of n bytes costs O(n) copying however it arrives.
+// Returns NULL with errno EMSGSIZE if the partial packet is already
+// longer than max_packet_size, or ENOMEM.
+char *framer_recv_space(struct packet_framer *p_framer, size_t *p_space)
+{
+    size_t new_size;
+    char *new_buf;
+
+    if (p_framer->max_packet_size &&
+	(p_framer->len - p_framer->start > p_framer->max_packet_size)) {
+	errno = EMSGSIZE;
+	return NULL;
+    }
+
+    if (p_framer->start == p_framer->len) {
+	// Nothing buffered.  Give back memory from a huge packet.
+	p_framer->start = p_framer->len = p_framer->scan_pos = 0;
+	if ((p_framer->size > FRAMER_SHRINK_SIZE) &&
+	    (p_framer->size > p_framer->min_size) &&
+	    (new_buf = realloc(p_framer->buf, p_framer->min_size))) {
+	    p_framer->buf = new_buf;
+	    p_framer->size = p_framer->min_size;
+	}
+    } else if ((p_framer->len == p_framer->size) && p_framer->start) {
+	memmove(p_framer->buf, p_framer->buf + p_framer->start,
+		p_framer->len - p_framer->start);
+	p_framer->len -= p_framer->start;
+	p_framer->scan_pos -= p_framer->start;
+	p_framer->start = 0;
+    }
+
+    if (p_framer->len == p_framer->size) {
+	new_size = p_framer->size * 2;
+	// Room for the largest packet plus its newline is all we need
+	if (p_framer->max_packet_size &&
+	    (new_size > p_framer->max_packet_size + 1)) {
+	    new_size = p_framer->max_packet_size + 1;
+	}
+	if (new_size <= p_framer->size) {
+	    errno = EMSGSIZE;
+	    return NULL;
+	}
+	if (!(new_buf = realloc(p_framer->buf, new_size))) {
+	    return NULL;
+	}
+	p_framer->buf = new_buf;
+	p_framer->size = new_size;
+    }
+
+    *p_space = p_framer->size - p_framer->len;
+    return p_framer->buf + p_framer->len;
+}
+
+// Account for bytes received into the space from framer_recv_space().
+void framer_commit(struct packet_framer *p_framer, size_t bytes)
+{
+    p_framer->len += bytes;
+    STATS_ADD(bytes_in, bytes);
+}
+
+// Return the next complete packet, NUL terminated in place of its
+// newline, with its length (excluding the newline) in *p_len.  The
+// packet stays valid until the next framer_recv_space().  Returns NULL
+// if no complete packet has been received.
+char *framer_next_packet(struct packet_framer *p_framer, size_t *p_len)
+{
+    char *newline_ptr, *packet;
+
+    newline_ptr = memchr(p_framer->buf + p_framer->scan_pos, '\n',
+			 p_framer->len - p_framer->scan_pos);
+    if (!newline_ptr) {
+	// Don't re-scan what we've already seen
+	p_framer->scan_pos = p_framer->len;
+	return NULL;
+    }
+    *newline_ptr = 0;
+    packet = p_framer->buf + p_framer->start;
+    *p_len = newline_ptr - packet;
+    p_framer->start = p_framer->scan_pos = newline_ptr + 1 - p_framer->buf;
+    return packet;
+}
+
+// Initialize an empty packet batch.
+void batch_init(struct packet_batch *p_batch)
+{
+    p_batch->num_packets = p_batch->num_replies = p_batch->next_reply = 0;
+}
+
+// Make p_batch empty, releasing any replies still in it.
+void batch_free(struct datafile *p_datafile, struct packet_batch *p_batch)
+{
+    int i;
+
+    for (i = 0; i < p_batch->num_replies; i++) {
+	reply_free(p_datafile, &p_batch->replies[i]);
+    }
+    batch_init(p_batch);
+}
+
+// True if p_batch has replies that haven't been completely sent yet.
+int batch_pending(struct packet_batch *p_batch)
+{
+    return p_batch->next_reply < p_batch->num_replies;
+}
+
+// Capture the reply to the packet described by p_cmd as the next reply
+// in p_batch, or merge it into the last one if that's a range of the
+// data file ending where this one starts.  Must be called with the data
+// file lock held.  Returns 0 on success, -1 on error.
+int batch_capture_reply(struct datafile *p_datafile,
+			struct client_session *p_session,
+			const struct packet_cmd *p_cmd,
+			struct packet_batch *p_batch, long long start_ns)
+{
+    struct reply *p_reply = &p_batch->replies[p_batch->num_replies];
+    struct reply *p_last = p_reply - 1;
+
+    reply_init(p_reply);
+    p_reply->start_ns = start_ns;
+    if (packet_capture_reply(p_datafile, p_session, p_cmd, p_reply)) {
+	return -1;
+    }
+    if (p_batch->num_replies && (-1 != p_last->fd) && (-1 != p_reply->fd) &&
+	(p_last->end == p_reply->offset)) {
+	p_last->end = p_reply->end;
+	reply_free(p_datafile, p_reply);
+    } else {
+	p_batch->num_replies++;
+    }
+    return 0;
+}
+
+// Handle the complete packets received from a client so far, up to
+// PACKET_BATCH_MAX of them, with one acquisition of the data file lock.
+// Each run of data packets is appended with one writev(), and inline
+// commands are applied in between, in packet order.  The char device
+// gets one packet per write instead.  It would split a longer write at
+// its newlines, but each reply has to see the device as it was right
+// after its own packet, before later entries push out older ones.  The
+// replies are captured in *p_batch, which the caller sends with
+// batch_send() once the lock has been dropped - a slow client never
+// holds up anyone else.  Returns 0 on success, check num_packets for
+// whether there were any, or -1 on error.
+int handle_packets(struct datafile *p_datafile,
+		   struct client_session *p_session,
+		   struct packet_framer *p_framer, struct packet_batch *p_batch)
+{
+    struct iovec iov[2 * PACKET_BATCH_MAX];
+    struct packet_cmd *p_cmd;
+    long long start_ns;
+    off_t append_end;
+    int exclusive = 0, num_iov, i, j, n;
+    int retval = -1;
+
+    batch_free(p_datafile, p_batch);
+    for (n = 0; n < PACKET_BATCH_MAX; n++) {
+	if (!(p_batch->packets[n] =
+	      framer_next_packet(p_framer, &p_batch->packet_lens[n]))) {
+	    break;
+	}
+	parse_packet(p_batch->packets[n], &p_batch->cmds[n]);
+	exclusive |= packet_needs_exclusive(p_datafile, &p_batch->cmds[n]);
+    }
+    if (!(p_batch->num_packets = n)) {
+	return 0;
+    }
+
+    STATS_ADD(packets_in, n);
+    start_ns = monotonic_ns();
+    if (datafile_rwlock(p_datafile, exclusive)) {
+	return -1;
+    }
+
+    for (i = 0; i < n; i = j) {
+	j = i + 1;
+	append_end = p_datafile->size;
+	if (PACKET_DATA == p_batch->cmds[i].type) {
+	    // Each packet takes two iovecs, itself and its newline
+	    for (j = i, num_iov = 0;
+		 (j < n) && (PACKET_DATA == p_batch->cmds[j].type) &&
+		     (p_datafile->is_regular || (j == i)); j++) {
+		iov[num_iov].iov_base = p_batch->packets[j];
+		iov[num_iov++].iov_len = p_batch->packet_lens[j];
+		iov[num_iov].iov_base = "\n";
+		iov[num_iov++].iov_len = 1;
+	    }
+	    if (datafile_appendv(p_datafile, iov, num_iov)) {
+		goto unlock;
+	    }
+	}
+	for (; i < j; i++) {
+	    p_cmd = &p_batch->cmds[i];
+	    if (PACKET_DATA == p_cmd->type) {
+		// Each reply ends with its own packet, short of a
+		// partial write
+		append_end += p_batch->packet_lens[i] + 1;
+		p_cmd->append_end = (append_end < p_datafile->size) ?
+		    append_end : p_datafile->size;
+	    }
+	    if (batch_capture_reply(p_datafile, p_session, p_cmd, p_batch,
+				    start_ns)) {
+		goto unlock;
+	    }
+	}
+    }
+    retval = 0;
+
+unlock:
+    if (pthread_rwlock_unlock(&p_datafile->lock)) {
+	perror("pthread_rwlock_unlock");
+	batch_free(p_datafile, p_batch);
+	return -1;
+    }
+    return retval;
+}
+
+// Send the replies in p_batch in order, as much as the socket will
+// take (see reply_send()).  While more than one reply is going out the
+// socket is corked, so they fill whole segments instead of each ending
+// in a small one.  Returns 0 on success, check batch_pending() for
+// completion, or -1 on error.
+int batch_send(struct datafile *p_datafile, int conn_fd,
+	       struct packet_batch *p_batch)
+{
+    struct reply *p_reply;
+    int cork;
+
+    // Corking only saves segments, carry on without it
+    if (p_batch->num_replies - p_batch->next_reply > 1) {
+	cork = 1;
+	(void) setsockopt(conn_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+    while (batch_pending(p_batch)) {
+	p_reply = &p_batch->replies[p_batch->next_reply];
+	if (reply_send(p_datafile, conn_fd, p_reply)) {
+	    return -1;
+	}
+	if (reply_pending(p_reply)) {
+	    return 0;
+	}
+	p_batch->next_reply++;
+    }
+    if (p_batch->num_replies > 1) {
+	cork = 0;
+	(void) setsockopt(conn_fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    }
+    return 0;
+}
+
+// Log a connection closed by the client, or dropped for a protocol or
+// I/O error (errno), along with any partial packet being thrown away.
+void log_connection_closed(struct packet_framer *p_framer,
+			   const char *client_ip_addr_str, int error)
+{
+    if (EMSGSIZE == error) {
+	syslog(LOG_USER|LOG_ERR, "Packet from %s too long, closing connection",
+	       client_ip_addr_str);
+    }
+    STATS_ADD(conns_closed, 1);
+    if (p_framer->len != p_framer->start) {
+	PRINTF("Discarding %ld bytes of unterminated packet\n",
+	       p_framer->len - p_framer->start);
+    }
+    PRINTF("Closed connection from %s\n", client_ip_addr_str);
+    syslog(LOG_USER|LOG_INFO, "Closed connection from %s",
+	   client_ip_addr_str);
+}
+
+// Handle a single connection from a client until it closes or an error
+// occurs.  Frees everything it allocates; the connection socket belongs
+// to the caller.
+void serve_client(struct server_thread_data *p_thread_data)
+{
+    struct datafile *p_datafile = p_thread_data->p_datafile;
+    struct packet_framer framer;
+    char *recv_buf;
+    size_t recv_space;
+    ssize_t bytes_read;
+    struct packet_batch batch;
+
+    if (framer_init(&framer, p_thread_data->p_config->max_packet_size,
+		    p_thread_data->p_config->recv_buf_size)) {
+	return;
+    }
+    batch_init(&batch);
+
+    while (!p_thread_data->client_done) {
+	if (!(recv_buf = framer_recv_space(&framer, &recv_space))) {
+	    break;
+	}
+	bytes_read = recv(p_thread_data->conn_fd, recv_buf, recv_space, 0);
+	if (-1 == bytes_read) {
+	    // -1 on error
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    perror("recv");
+	    break;
+	} else if (0 == bytes_read) {
+	    // 0 on remote connection closed
+	    p_thread_data->client_done = 1;
+	    errno = 0;
+	    break;
+	}
+	framer_commit(&framer, bytes_read);
+
+	// Handle every complete packet received so far, a batch at a
+	// time.  Append (or apply inline commands) under the data file
+	// lock, then send the replies captured there without it.
+	do {
+	    if (handle_packets(p_datafile, &p_thread_data->session, &framer,
+			       &batch) ||
+		batch_send(p_datafile, p_thread_data->conn_fd, &batch)) {
+		batch_free(p_datafile, &batch);
+		goto close_conn;
+	    }
+	} while (batch.num_packets);
+    }
+
+close_conn:
+    // Let the client see a connection dropped for an error right away;
+    // the caller closes conn_fd.
+    if (!p_thread_data->client_done) {
+	shutdown(p_thread_data->conn_fd, SHUT_RDWR);
+    }
+    log_connection_closed(&framer, p_thread_data->client_ip_addr_str, errno);
+    framer_free(&framer);
+    session_free(&p_thread_data->session);
+}
+
+// Server thread to handle a single connection from a client.
+// Must free any resources allocated in the thread (ie malloc buffer).
+// Connection socket, etc allocated in main are cleaned up in main
+// thread after server thread exits.
+void *server_thread(void *arg)
+{
+    struct server_thread_data *p_thread_data = (struct server_thread_data *)arg;
+
+    struct thread_completions *p_completions = p_thread_data->p_completions;
+    uint64_t one = 1;
+
+    if (!block_server_signals()) {
+	serve_client(p_thread_data);
+    }
+    // Queue ourselves for main to join.  p_thread_data may be freed as
+    // soon as the lock is dropped, so don't touch it after that.
+    pthread_mutex_lock(&p_completions->lock);
+    SLIST_INSERT_HEAD(&p_completions->done, p_thread_data, done_entries);
+    pthread_mutex_unlock(&p_completions->lock);
+    if (-1 == write(p_completions->event_fd, &one, sizeof(one))) {
+	perror("write eventfd");
+    }
+    return NULL;
+}
+
+// Join every server thread on the completion queue and free what main
+// allocated for it.  Each is unlinked from the active list in O(1), so
+// the cost is per finished thread, not per connection.  Returns the
+// number of threads reaped.
+int reap_server_threads(struct thread_completions *p_completions)
+{
+    struct server_thread_data *p_thread_data, *p_next;
+    uint64_t count;
+    int num_reaped = 0;
+
+    // Reset the eventfd counter before taking the list, so a thread
+    // that finishes after this point wakes the next poll().
+    if (-1 == read(p_completions->event_fd, &count, sizeof(count)) &&
+	(EAGAIN != errno)) {
+	perror("read eventfd");
+    }
+    pthread_mutex_lock(&p_completions->lock);
+    p_thread_data = SLIST_FIRST(&p_completions->done);
+    SLIST_INIT(&p_completions->done);
+    pthread_mutex_unlock(&p_completions->lock);
+
+    for (; p_thread_data; p_thread_data = p_next) {
+	p_next = SLIST_NEXT(p_thread_data, done_entries);
+	LIST_REMOVE(p_thread_data, entries);
+	PRINTF("Reaping thread data = %p\n", p_thread_data);
+	if (pthread_join(p_thread_data->thread_id, NULL)) {
+	    perror("pthread_join");
+	}
+	shutdown(p_thread_data->conn_fd, SHUT_RDWR);
+	close(p_thread_data->conn_fd);
+	free(p_thread_data);
+	num_reaped++;
+    }
+    return num_reaped;
+}
+
+// Connection loop for SERVER_MODE_THREAD: a server_thread per client.
+// main sleeps in poll() on the listening socket, the completion queue's
+// eventfd, the timestamp timer and a signalfd for SIGINT/SIGTERM, so
+// timestamps go out on time and finished threads are
+// joined as soon as they exit rather than on the next accept.  With
+// max_connections set, the listening socket is left out of the poll set
+// while that many clients are being served.
+//
+// On a signal, stops accepting and drains: each connection's read side
+// is shut down, so its thread answers the packets it has already
+// received, sends the replies and exits.  Connections still busy after
+// drain_secs (-w) are shut down outright.  Returns 0 after draining on a
+// signal, -1 on error.
+int thread_server_loop(int sock_fd, struct datafile *p_datafile,
+		       pthread_attr_t *p_thread_attr,
+		       const struct server_config *p_config)
+{
+    int max_connections = p_config->max_connections;
+    int drain_secs = p_config->drain_secs;
+    LIST_HEAD(, server_thread_data) active;
+    struct thread_completions completions;
+    struct server_thread_data *p_thread_data;
+    struct signalfd_siginfo siginfo;
+    struct pollfd fds[4];
+    long long deadline_ns, timeout_ms;
+    int conn_fd, nfds, num_active = 0;
+
+    LIST_INIT(&active);
+    SLIST_INIT(&completions.done);
+    if (pthread_mutex_init(&completions.lock, NULL)) {
+	perror("pthread_mutex_init");
+	return -1;
+    }
+    if (-1 == (completions.event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC))) {
+	perror("eventfd");
+	return -1;
+    }
+
+    // poll() says when to accept; don't block if the client is gone by
+    // the time we get there.
+    if (-1 == fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK)) {
+	perror("fcntl");
+	return -1;
+    }
+
+    while (!caught_signal) {
+	fds[0].fd = signal_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = completions.event_fd;
+	fds[1].events = POLLIN;
+	fds[2].fd = timestamp_timer.timer_fd;	// poll() ignores -1
+	fds[2].events = POLLIN;
+	fds[3].fd = sock_fd;
+	fds[3].events = POLLIN;
+	nfds = (!max_connections || (num_active < max_connections)) ? 4 : 3;
+	if (-1 == poll(fds, nfds, -1)) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    perror("poll");
+	    return -1;
+	}
+	if (fds[0].revents & POLLIN) {
+	    if (sizeof(siginfo) == read(signal_fd, &siginfo, sizeof(siginfo))) {
+		caught_signal = siginfo.ssi_signo;
+	    }
+	    break;
+	}
+	if (fds[1].revents & POLLIN) {
+	    num_active -= reap_server_threads(&completions);
+	}
+	if (fds[2].revents & POLLIN) {
+	    (void) timestamp_timer_fire();
+	}
+	if ((nfds < 4) || !(fds[3].revents & POLLIN)) {
+	    continue;
+	}
+
+	if (!(p_thread_data = malloc(sizeof(struct server_thread_data)))) {
+	    perror("malloc");
+	    return -1;
+	}
+	if (-1 == (conn_fd =
+		   accept_client(sock_fd, p_thread_data->client_ip_addr_str,
+				 p_thread_data->client_port_str))) {
+	    free(p_thread_data);
+	    // Client gave up before we got to it, or a transient failure
+	    if ((EAGAIN == errno) || (EWOULDBLOCK == errno) ||
+		(ECONNABORTED == errno) || (EINTR == errno) ||
+		(EINVAL == errno)) {
+		continue;
+	    }
+	    perror("accept");
+	    return -1;
+	}
+
+	p_thread_data->p_datafile   = p_datafile;
+	p_thread_data->conn_fd      = conn_fd;
+	p_thread_data->sock_fd      = sock_fd;
+	p_thread_data->client_done  = 0;
+	p_thread_data->p_config     = p_config;
+	p_thread_data->p_completions = &completions;
+	bzero(&p_thread_data->session, sizeof(struct client_session));
+
+	if (pthread_create(&(p_thread_data->thread_id), p_thread_attr,
+			   server_thread, (void *) p_thread_data)) {
+	    perror("pthread_create");
+	    shutdown(conn_fd, SHUT_RDWR);
+	    close(conn_fd);
+	    free(p_thread_data);
+	    return -1;
+	}
+	PRINTF("pthread_create successful, p_thread_data = %p\n",
+	       p_thread_data);
+	LIST_INSERT_HEAD(&active, p_thread_data, entries);
+	num_active++;
+    }
+
+    // Drain.  Stop listening, then shut down the read side of every
+    // connection: once its thread has consumed what's already buffered,
+    // recv() returns 0 and it finishes up as if the client had closed.
+    PRINTF("Caught signal, draining %d connections\n", num_active);
+    shutdown(sock_fd, SHUT_RDWR);
+    LIST_FOREACH(p_thread_data, &active, entries) {
+	shutdown(p_thread_data->conn_fd, SHUT_RD);
+    }
+    deadline_ns = monotonic_ns() + drain_secs * 1000000000LL;
+    timeout_ms = 0;
+    while (num_active) {
+	if ((timeout_ms >= 0) &&
+	    ((timeout_ms = (deadline_ns - monotonic_ns()) / 1000000) <= 0)) {
+	    // Out of time.  Shutting down the write side too fails any
+	    // reply still blocked in send, so the rest exit promptly.
+	    syslog(LOG_USER|LOG_WARNING,
+		   "%d connections still busy after %d s, closing them",
+		   num_active, drain_secs);
+	    LIST_FOREACH(p_thread_data, &active, entries) {
+		shutdown(p_thread_data->conn_fd, SHUT_RDWR);
+	    }
+	    timeout_ms = -1;
+	}
+	fds[0].fd = completions.event_fd;
+	fds[0].events = POLLIN;
+	if ((-1 == poll(fds, 1, timeout_ms)) && (EINTR != errno)) {
+	    perror("poll");
+	    return -1;
+	}
+	num_active -= reap_server_threads(&completions);
+    }
+    close(completions.event_fd);
+    return 0;
+}
+
+// Free all resources for an epoll connection.  Closing conn_fd removes
+// it from the epoll set.
+void epoll_conn_free(struct epoll_conn_data *p_conn)
+{
+    log_connection_closed(&p_conn->framer, p_conn->client_ip_addr_str, errno);
+    shutdown(p_conn->conn_fd, SHUT_RDWR);
+    close(p_conn->conn_fd);
+    batch_free(p_conn->p_datafile, &p_conn->batch);
+    framer_free(&p_conn->framer);
+    session_free(&p_conn->session);
+    free(p_conn);
+    conn_slot_release();
+}
+
+// Take an epoll connection off its event loop thread's list and free it.
+void epoll_conn_close(struct epoll_thread_data *p_thread_data,
+		      struct epoll_conn_data *p_conn)
+{
+    pthread_mutex_lock(&p_thread_data->conns_lock);
+    LIST_REMOVE(p_conn, entries);
+    pthread_mutex_unlock(&p_thread_data->conns_lock);
+    epoll_conn_free(p_conn);
+}
+
+// Process complete packets in the receive buffer, a batch at a time,
+// until none are left or a reply couldn't be sent without blocking.
+// Only one batch is outstanding at a time, so replies go out in packet
+// order and a client that doesn't read its replies stops being read
+// from.  Returns 0 on success, -1 on error.
+int epoll_conn_process(struct epoll_thread_data *p_thread_data,
+		       struct epoll_conn_data *p_conn)
+{
+    struct epoll_event event;
+
+    while (!batch_pending(&p_conn->batch)) {
+	if (handle_packets(p_conn->p_datafile, &p_conn->session,
+			   &p_conn->framer, &p_conn->batch) ||
+	    batch_send(p_conn->p_datafile, p_conn->conn_fd, &p_conn->batch)) {
+	    return -1;
+	}
+	if (!p_conn->batch.num_packets) {
+	    break;
+	}
+    }
+
+    // Wait for the socket to drain if a reply is pending, otherwise for
+    // more data from the client.
+    event.events = batch_pending(&p_conn->batch) ? EPOLLOUT : EPOLLIN;
+    event.data.ptr = p_conn;
+    if (epoll_ctl(p_thread_data->epoll_fd, EPOLL_CTL_MOD, p_conn->conn_fd,
+		  &event)) {
+	perror("epoll_ctl");
+	return -1;
+    }
+    return 0;
+}
+
+// Read whatever the client has sent into the packet framer.  Returns 0
+// on success, 1 if the client closed the connection, -1 on error.
+int epoll_conn_recv(struct epoll_conn_data *p_conn)
+{
+    ssize_t bytes_read;
+    size_t recv_space;
+    char *recv_buf;
+
+    if (!(recv_buf = framer_recv_space(&p_conn->framer, &recv_space))) {
+	return -1;
+    }
+    bytes_read = recv(p_conn->conn_fd, recv_buf, recv_space, 0);
+    if (-1 == bytes_read) {
+	if ((EAGAIN == errno) || (EWOULDBLOCK == errno) || (EINTR == errno)) {
+	    return 0;
+	}
+	perror("recv");
+	return -1;
+    } else if (0 == bytes_read) {
+	errno = 0;
+	return 1;
+    }
+    framer_commit(&p_conn->framer, bytes_read);
+    return 0;
+}
+
+// Set up p_conn for the new connection conn_fd and add it to the event
+// loop thread's epoll set.  After this, p_conn belongs to that thread.
+// Returns 0 on success, or -1 on error after closing the connection.
+int epoll_conn_add(struct epoll_thread_data *p_thread_data,
+		   struct epoll_conn_data *p_conn, int conn_fd)
+{
+    const struct server_config *p_config = p_thread_data->p_config;
+    struct epoll_event event;
+    int draining;
+
+    p_conn->conn_fd = conn_fd;
+    p_conn->p_datafile = p_thread_data->p_datafile;
+    batch_init(&p_conn->batch);
+    if (framer_init(&p_conn->framer, p_config->max_packet_size,
+		    p_config->recv_buf_size)) {
+	shutdown(conn_fd, SHUT_RDWR);
+	close(conn_fd);
+	free(p_conn);
+	STATS_ADD(conns_closed, 1);
+	conn_slot_release();
+	return -1;
+    }
+
+    // main may have accepted this one as the thread started draining;
+    // it's too late to serve it then.
+    pthread_mutex_lock(&p_thread_data->conns_lock);
+    if (!(draining = p_thread_data->draining)) {
+	LIST_INSERT_HEAD(&p_thread_data->conns, p_conn, entries);
+    }
+    pthread_mutex_unlock(&p_thread_data->conns_lock);
+    if (draining) {
+	errno = 0;
+	epoll_conn_free(p_conn);
+	return -1;
+    }
+
+    if (-1 == fcntl(conn_fd, F_SETFL, fcntl(conn_fd, F_GETFL) | O_NONBLOCK)) {
+	perror("fcntl");
+	epoll_conn_close(p_thread_data, p_conn);
+	return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = p_conn;
+    if (epoll_ctl(p_thread_data->epoll_fd, EPOLL_CTL_ADD, conn_fd, &event)) {
+	perror("epoll_ctl");
+	epoll_conn_close(p_thread_data, p_conn);
+	return -1;
+    }
+    return 0;
+}
+
+// Switch an event loop thread between watching its listener (-P) and,
+// while every connection slot (-c) is taken, watching for a slot to be
+// given back instead.  EPOLLEXCLUSIVE wakes one waiting thread per
+// slot rather than all of them.  Returns 0 on success, -1 on error.
+int epoll_watch_slots(struct epoll_thread_data *p_thread_data, int watch)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | (watch ? EPOLLEXCLUSIVE : 0);
+    event.data.ptr = watch ? (void *) &conn_slots_fd : (void *) p_thread_data;
+    if (epoll_ctl(p_thread_data->epoll_fd, EPOLL_CTL_DEL,
+		  watch ? p_thread_data->listen_fd : conn_slots_fd, NULL) ||
+	epoll_ctl(p_thread_data->epoll_fd, EPOLL_CTL_ADD,
+		  watch ? conn_slots_fd : p_thread_data->listen_fd, &event)) {
+	perror("epoll_ctl");
+	return -1;
+    }
+    p_thread_data->waiting_for_slot = watch;
+    return 0;
+}
+
+// Accept every connection waiting on an event loop thread's own
+// listener (-P) into its epoll set, as long as there are connection
+// slots for them.  Returns 0 on success, -1 on error.
+int epoll_accept(struct epoll_thread_data *p_thread_data)
+{
+    struct epoll_conn_data *p_conn;
+    int conn_fd;
+
+    while (1) {
+	if (conn_slot_try_acquire()) {
+	    if (EAGAIN != errno) {
+		perror("read eventfd");
+		return -1;
+	    }
+	    return p_thread_data->waiting_for_slot ? 0 :
+		epoll_watch_slots(p_thread_data, 1);
+	}
+	if (p_thread_data->waiting_for_slot &&
+	    epoll_watch_slots(p_thread_data, 0)) {
+	    conn_slot_release();
+	    return -1;
+	}
+
+	if (!(p_conn = calloc(1, sizeof(struct epoll_conn_data)))) {
+	    perror("calloc");
+	    conn_slot_release();
+	    return -1;
+	}
+	if (-1 == (conn_fd = accept_client(p_thread_data->listen_fd,
+					   p_conn->client_ip_addr_str,
+					   p_conn->client_port_str))) {
+	    free(p_conn);
+	    conn_slot_release();
+	    // Nothing (more) waiting, or the client gave up already
+	    if ((EAGAIN == errno) || (EWOULDBLOCK == errno) ||
+		(ECONNABORTED == errno) || (EINTR == errno) ||
+		(EINVAL == errno)) {
+		return 0;
+	    }
+	    perror("accept");
+	    return -1;
+	}
+	(void) epoll_conn_add(p_thread_data, p_conn, conn_fd);
+    }
+}
+
+// Stop an event loop thread taking new connections and start draining
+// the ones it has: each one's read side is shut down, so once it has
+// been answered up to what the client already sent, it closes as if
+// the client had.  The signal stays pending for the other threads.
+// Returns 0 on success, -1 on error.
+int epoll_start_drain(struct epoll_thread_data *p_thread_data)
+{
+    struct epoll_conn_data *p_conn;
+
+    if (epoll_ctl(p_thread_data->epoll_fd, EPOLL_CTL_DEL, signal_fd, NULL) ||
+	((-1 != p_thread_data->listen_fd) &&
+	 epoll_ctl(p_thread_data->epoll_fd, EPOLL_CTL_DEL,
+		   p_thread_data->waiting_for_slot ? conn_slots_fd :
+		   p_thread_data->listen_fd, NULL))) {
+	perror("epoll_ctl");
+	return -1;
+    }
+    if (-1 != p_thread_data->listen_fd) {
+	shutdown(p_thread_data->listen_fd, SHUT_RDWR);
+    }
+
+    pthread_mutex_lock(&p_thread_data->conns_lock);
+    p_thread_data->draining = 1;
+    LIST_FOREACH(p_conn, &p_thread_data->conns, entries) {
+	shutdown(p_conn->conn_fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&p_thread_data->conns_lock);
+    p_thread_data->deadline_ns = monotonic_ns() +
+	p_thread_data->p_config->drain_secs * 1000000000LL;
+    return 0;
+}
+
+// Close the connections an event loop thread still has once it's out of
+// time draining.
+void epoll_close_all(struct epoll_thread_data *p_thread_data)
+{
+    struct epoll_conn_data *p_conn;
+    int num_conns = 0;
+
+    LIST_FOREACH(p_conn, &p_thread_data->conns, entries) {
+	num_conns++;
+    }
+    syslog(LOG_USER|LOG_WARNING,
+	   "%d connections still busy after %d s, closing them",
+	   num_conns, p_thread_data->p_config->drain_secs);
+    while ((p_conn = LIST_FIRST(&p_thread_data->conns))) {
+	errno = ETIMEDOUT;
+	epoll_conn_close(p_thread_data, p_conn);
+    }
+}
+
+// Event loop thread.  Services every connection main added to this
+// thread's epoll set, or the thread accepted itself (-P); each
+// connection is a small state machine that is either receiving a packet
+// or sending a reply.  On a signal, drains its connections (see
+// epoll_start_drain()) and exits once they're closed or drain_secs (-w)
+// is up.
+void *epoll_thread(void *arg)
+{
+    struct epoll_thread_data *p_thread_data = (struct epoll_thread_data *)arg;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    struct epoll_conn_data *p_conn;
+    long long timeout_ms = -1;
+    int num_events, i, status;
+
+    if (block_server_signals()) {
+	pthread_exit(p_thread_data);
+    }
+
+    // Nothing adds connections once draining is set
+    while (!p_thread_data->draining || !LIST_EMPTY(&p_thread_data->conns)) {
+	if (p_thread_data->draining &&
+	    ((timeout_ms = (p_thread_data->deadline_ns - monotonic_ns()) /
+	      1000000) <= 0)) {
+	    epoll_close_all(p_thread_data);
+	    break;
+	}
+	num_events = epoll_wait(p_thread_data->epoll_fd, events,
+				EPOLL_MAX_EVENTS, (int) timeout_ms);
+	if (-1 == num_events) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    perror("epoll_wait");
+	    pthread_exit(p_thread_data);
+	}
+
+	for (i = 0; i < num_events; i++) {
+	    if (events[i].data.ptr == (void *) &signal_fd) {
+		if (epoll_start_drain(p_thread_data)) {
+		    pthread_exit(p_thread_data);
+		}
+		continue;
+	    }
+	    // Our own listener, or a connection slot given back
+	    if ((events[i].data.ptr == (void *) p_thread_data) ||
+		(events[i].data.ptr == (void *) &conn_slots_fd)) {
+		if (!p_thread_data->draining && epoll_accept(p_thread_data)) {
+		    pthread_exit(p_thread_data);
+		}
+		continue;
+	    }
+	    p_conn = (struct epoll_conn_data *) events[i].data.ptr;
+	    if (batch_pending(&p_conn->batch)) {
+		status = batch_send(p_conn->p_datafile, p_conn->conn_fd,
+				    &p_conn->batch);
+	    } else {
+		status = epoll_conn_recv(p_conn);
+	    }
+	    if (!status) {
+		status = epoll_conn_process(p_thread_data, p_conn);
+	    }
+	    if (status) {
+		epoll_conn_close(p_thread_data, p_conn);
+	    }
+	}
+    }
+    return p_thread_data;
+}
+
+// Accept loop for SERVER_MODE_EPOLL.  Starts num_threads event loop
+// threads and hands accepted connections to them round robin.  With -P
+// each thread instead accepts on its own SO_REUSEPORT listener, thread
+// 0 on sock_fd, and the kernel spreads connections across them, so
+// there's no single accept loop to bottleneck a connection storm.
+// On a signal, stops accepting and waits for every thread to drain its
+// connections, see epoll_thread().  Returns 0 after draining on a
+// signal, -1 on error.
+int epoll_server_loop(int sock_fd, struct datafile *p_datafile,
+		      const struct server_config *p_config)
+{
+    int num_threads = p_config->num_threads;
+    struct epoll_thread_data *p_threads;
+    struct epoll_conn_data *p_conn;
+    struct epoll_event event;
+    pthread_attr_t thread_attr;
+    int conn_fd, next_thread, i;
+
+    if (!(p_threads = calloc(num_threads, sizeof(struct epoll_thread_data)))) {
+	perror("calloc");
+	return -1;
+    }
+
+    if (server_thread_attr_init(&thread_attr)) {
+	return -1;
+    }
+    for (i = 0; i < num_threads; i++) {
+	p_threads[i].p_datafile = p_datafile;
+	p_threads[i].p_config = p_config;
+	p_threads[i].listen_fd = -1;
+	LIST_INIT(&p_threads[i].conns);
+	if (pthread_mutex_init(&p_threads[i].conns_lock, NULL)) {
+	    perror("pthread_mutex_init");
+	    return -1;
+	}
+	if (-1 == (p_threads[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC))) {
+	    perror("epoll_create1");
+	    return -1;
+	}
+	// Every thread sees the signal, it's never read
+	event.events = EPOLLIN;
+	event.data.ptr = &signal_fd;
+	if (epoll_ctl(p_threads[i].epoll_fd, EPOLL_CTL_ADD, signal_fd, &event)) {
+	    perror("epoll_ctl");
+	    return -1;
+	}
+	if (p_config->reuseport) {
+	    p_threads[i].listen_fd = i ? socket_init(p_config->port,
+						     p_config->listen_backlog,
+						     1) : sock_fd;
+	    event.events = EPOLLIN;
+	    event.data.ptr = &p_threads[i];
+	    if ((-1 == fcntl(p_threads[i].listen_fd, F_SETFL,
+			     fcntl(p_threads[i].listen_fd, F_GETFL) |
+			     O_NONBLOCK)) ||
+		epoll_ctl(p_threads[i].epoll_fd, EPOLL_CTL_ADD,
+			  p_threads[i].listen_fd, &event)) {
+		perror("epoll_ctl");
+		return -1;
+	    }
+	}
+	if (pthread_create(&(p_threads[i].thread_id), &thread_attr,
+			   epoll_thread, (void *) &p_threads[i])) {
+	    perror("pthread_create");
+	    return -1;
+	}
+    }
+    pthread_attr_destroy(&thread_attr);
+    PRINTF("Started %d epoll threads\n", num_threads);
+
+    next_thread = 0;
+    while (!p_config->reuseport) {
+	if (!(p_conn = calloc(1, sizeof(struct epoll_conn_data)))) {
+	    perror("calloc");
+	    return -1;
+	}
+	if (-1 == (conn_fd =
+		   wait_for_client_connection(sock_fd,
+					      p_conn->client_ip_addr_str,
+					      p_conn->client_port_str))) {
+	    free(p_conn);
+	    if (EINTR == errno) {
+		break;
+	    }
+	    return -1;
+	}
+	(void) epoll_conn_add(&p_threads[next_thread], p_conn, conn_fd);
+	next_thread = (next_thread + 1) % num_threads;
+    }
+    if (p_config->reuseport && wait_for_signal()) {
+	return -1;
+    }
+
+    PRINTF("Caught signal, draining %d epoll threads\n", num_threads);
+    shutdown(sock_fd, SHUT_RDWR);
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_join(p_threads[i].thread_id, NULL)) {
+	    perror("pthread_join");
+	}
+    }
+    return 0;
+}
+
+#ifdef USE_IO_URING
+// Set up p_ring with room for at least entries SQEs and map its queues.
+// Returns 0 on success, -1 on error.
+int uring_init(struct uring *p_ring, unsigned entries)
+{
+    struct io_uring_params params;
+    size_t sq_ring_size, cq_ring_size;
+    char *sq_ring, *cq_ring;
+
+    bzero(p_ring, sizeof(struct uring));
+    bzero(&params, sizeof(struct io_uring_params));
+    p_ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (-1 == p_ring->ring_fd) {
+	perror("io_uring_setup");
+	return -1;
+    }
+
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes +
+	params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both queues with one mmap
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) &&
+	(cq_ring_size > sq_ring_size)) {
+	sq_ring_size = cq_ring_size;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, p_ring->ring_fd,
+		   IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq_ring) {
+	perror("mmap");
+	return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+	cq_ring = sq_ring;
+    } else {
+	cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, p_ring->ring_fd,
+		       IORING_OFF_CQ_RING);
+	if (MAP_FAILED == cq_ring) {
+	    perror("mmap");
+	    return -1;
+	}
+    }
+    p_ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			p_ring->ring_fd, IORING_OFF_SQES);
+    if (MAP_FAILED == p_ring->sqes) {
+	perror("mmap");
+	return -1;
+    }
+
+    p_ring->sq_entries = params.sq_entries;
+    p_ring->sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+    p_ring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    p_ring->sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+    p_ring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+    p_ring->sq_local_tail = *p_ring->sq_tail;
+    p_ring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+    p_ring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    p_ring->cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+    p_ring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+    return 0;
+}
+
+// Hand the SQEs filled in since the last call to the kernel, and wait
+// for at least min_complete completions.  Returns 0 on success, -1 on
+// error (EINTR if a signal arrived while waiting).
+int uring_submit(struct uring *p_ring, unsigned min_complete)
+{
+    unsigned to_submit;
+
+    // The SQEs must be visible before the tail that publishes them
+    to_submit = p_ring->sq_local_tail - *p_ring->sq_tail;
+    __atomic_store_n(p_ring->sq_tail, p_ring->sq_local_tail, __ATOMIC_RELEASE);
+    if (-1 == syscall(__NR_io_uring_enter, p_ring->ring_fd, to_submit,
+		      min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0,
+		      NULL, 0)) {
+	return -1;
+    }
+    return 0;
+}
+
+// Get a zeroed SQE to fill in, tagged with op and p_conn.  Submits
+// what's queued if the SQ is full.  Returns NULL on error.
+struct io_uring_sqe *uring_get_sqe(struct uring *p_ring, enum uring_op op,
+				   struct uring_conn *p_conn)
+{
+    struct io_uring_sqe *p_sqe;
+    unsigned index;
+
+    if ((p_ring->sq_local_tail -
+	 __atomic_load_n(p_ring->sq_head, __ATOMIC_ACQUIRE)) >=
+	p_ring->sq_entries) {
+	if (uring_submit(p_ring, 0)) {
+	    perror("io_uring_enter");
+	    return NULL;
+	}
+    }
+    index = p_ring->sq_local_tail & *p_ring->sq_mask;
+    p_sqe = &p_ring->sqes[index];
+    bzero(p_sqe, sizeof(struct io_uring_sqe));
+    p_sqe->user_data = (uintptr_t) p_conn | op;
+    p_ring->sq_array[index] = index;
+    p_ring->sq_local_tail++;
+    return p_sqe;
+}
+
+// Keep URING_ACCEPT_DEPTH accepts posted, each into a free connection
+// slot, so a burst of connections doesn't overflow the listen backlog.
+// New sockets go straight into the fixed file table, never the fd
+// table.  Returns 0 on success, -1 on error.
+int uring_post_accepts(struct uring_server *p_server)
+{
+    struct uring_conn *p_conn;
+    struct io_uring_sqe *p_sqe;
+
+    while (!p_server->draining &&
+	   (p_server->accepts_posted < URING_ACCEPT_DEPTH) &&
+	   p_server->num_free_slots) {
+	p_conn = &p_server->conns[p_server->free_slots[p_server->num_free_slots - 1]];
+	if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_ACCEPT, p_conn))) {
+	    return -1;
+	}
+	p_server->num_free_slots--;
+	p_server->accepts_posted++;
+	p_conn->client_addr_len = sizeof(p_conn->client_addr);
+	p_sqe->opcode = IORING_OP_ACCEPT;
+	p_sqe->flags = IOSQE_FIXED_FILE;
+	p_sqe->fd = URING_LISTEN_FILE;
+	p_sqe->addr = (uintptr_t) &p_conn->client_addr;
+	p_sqe->addr2 = (uintptr_t) &p_conn->client_addr_len;
+	p_sqe->file_index = URING_FIRST_CONN_FILE + p_conn->slot + 1;
+    }
+    return 0;
+}
+
+// Post a recv into the free space of p_conn's framer.  Returns 0 on
+// success, -1 on error.
+int uring_post_recv(struct uring_server *p_server, struct uring_conn *p_conn)
+{
+    struct io_uring_sqe *p_sqe;
+    size_t recv_space;
+    char *recv_buf;
+
+    if (!(recv_buf = framer_recv_space(&p_conn->framer, &recv_space)) ||
+	!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_RECV, p_conn))) {
+	return -1;
+    }
+    p_sqe->opcode = IORING_OP_RECV;
+    p_sqe->flags = IOSQE_FIXED_FILE;
+    p_sqe->fd = URING_FIRST_CONN_FILE + p_conn->slot;
+    p_sqe->addr = (uintptr_t) recv_buf;
+    p_sqe->len = (recv_space > INT_MAX) ? INT_MAX : recv_space;
+    return 0;
+}
+
+// Post a one shot poll for fd to become readable, tagged with op.
+// Returns 0 on success, -1 on error.
+int uring_post_poll(struct uring_server *p_server, enum uring_op op, int fd)
+{
+    struct io_uring_sqe *p_sqe;
+
+    if (!(p_sqe = uring_get_sqe(&p_server->ring, op, NULL))) {
+	return -1;
+    }
+    p_sqe->opcode = IORING_OP_POLL_ADD;
+    p_sqe->fd = fd;
+    // The kernel swaps the halfwords back on big endian machines
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    p_sqe->poll32_events = POLLIN << 16;
+#else
+    p_sqe->poll32_events = POLLIN;
+#endif
+    return 0;
+}
+
+// Post a poll for the timestamp timer, if there is one, so the loop
+// can append timestamps between completions.  Returns 0 on success, -1
+// on error.
+int uring_post_timer(struct uring_server *p_server)
+{
+    if (-1 == timestamp_timer.timer_fd) {
+	return 0;
+    }
+    return uring_post_poll(p_server, URING_OP_TIMER, timestamp_timer.timer_fd);
+}
+
+// Post a send of len bytes of buf to p_conn's client.  Returns 0 on
+// success, -1 on error.
+int uring_post_send(struct uring_server *p_server, struct uring_conn *p_conn,
+		    const char *buf, size_t len)
+{
+    struct io_uring_sqe *p_sqe;
+
+    if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_SEND, p_conn))) {
+	return -1;
+    }
+    p_sqe->opcode = IORING_OP_SEND;
+    p_sqe->flags = IOSQE_FIXED_FILE;
+    p_sqe->fd = URING_FIRST_CONN_FILE + p_conn->slot;
+    p_sqe->addr = (uintptr_t) buf;
+    p_sqe->len = (len > INT_MAX) ? INT_MAX : len;
+    p_sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+// Post the next operation of p_conn's reply.  Ranges of the regular
+// data file are read a chunk at a time into the connection's registered
+// buffer and sent from there, char device snapshots are spliced out of
+// their pipe or sent from memory.  Returns 1 if an operation was posted,
+// 0 if the reply is complete (and has been freed), -1 on error.
+int uring_post_reply(struct uring_server *p_server, struct uring_conn *p_conn)
+{
+    struct reply *p_reply = &p_conn->reply;
+    struct io_uring_sqe *p_sqe;
+    size_t len;
+
+    if (p_conn->chunk_sent < p_conn->chunk_len) {
+	return uring_post_send(p_server, p_conn,
+			       p_conn->chunk + p_conn->chunk_sent,
+			       p_conn->chunk_len - p_conn->chunk_sent) ? -1 : 1;
+    }
+
+    if ((-1 != p_reply->fd) && (p_reply->offset < p_reply->end)) {
+	if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_READ, p_conn))) {
+	    return -1;
+	}
+	len = p_reply->end - p_reply->offset;	// Positive, checked above
+	p_sqe->opcode = IORING_OP_READ;
+	if (p_server->buffers_registered) {
+	    p_sqe->opcode = IORING_OP_READ_FIXED;
+	    p_sqe->buf_index = p_conn->slot;
+	}
+	p_sqe->flags = IOSQE_FIXED_FILE;
+	p_sqe->fd = URING_DATAFILE_FILE;
+	p_sqe->addr = (uintptr_t) p_conn->chunk;
+	p_sqe->len = (len > p_server->p_config->uring_chunk_size) ?
+	    p_server->p_config->uring_chunk_size : len;
+	p_sqe->off = p_reply->offset;
+	return 1;
+    }
+
+    if (p_reply->pipe_fds && p_reply->pipe_len) {
+	if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_SPLICE, p_conn))) {
+	    return -1;
+	}
+	// The fixed file flag applies to the socket, not the pipe
+	p_sqe->opcode = IORING_OP_SPLICE;
+	p_sqe->flags = IOSQE_FIXED_FILE;
+	p_sqe->fd = URING_FIRST_CONN_FILE + p_conn->slot;
+	p_sqe->off = (uint64_t) -1;
+	p_sqe->splice_fd_in = p_reply->pipe_fds[0];
+	p_sqe->splice_off_in = (uint64_t) -1;
+	p_sqe->len = p_reply->pipe_len;
+	p_sqe->splice_flags = SPLICE_F_MOVE;
+	return 1;
+    }
+
+    if (p_reply->buf && (p_reply->sent < p_reply->len)) {
+	return uring_post_send(p_server, p_conn, p_reply->buf + p_reply->sent,
+			       p_reply->len - p_reply->sent) ? -1 : 1;
+    }
+
+    if (p_reply->start_ns) {
+	stats_reply_done(p_reply);
+    }
+    reply_free(p_server->p_datafile, p_reply);
+    return 0;
+}
+
+// Capture p_conn's reply to the packet described by p_cmd under the data
+// file lock.  Returns 0 on success, -1 on error.
+int uring_conn_capture(struct uring_server *p_server, struct uring_conn *p_conn,
+		       const struct packet_cmd *p_cmd)
+{
+    struct datafile *p_datafile = p_server->p_datafile;
+    int retval;
+
+    // A data packet has already been appended, so its reply only reads
+    if ((PACKET_DATA == p_cmd->type) ? datafile_rwlock(p_datafile, 0) :
+	datafile_lock(p_datafile, p_cmd)) {
+	return -1;
+    }
+    retval = packet_capture_reply(p_datafile, &p_conn->session, p_cmd,
+				  &p_conn->reply);
+    if (pthread_rwlock_unlock(&p_datafile->lock)) {
+	perror("pthread_rwlock_unlock");
+	reply_free(p_datafile, &p_conn->reply);
+	return -1;
+    }
+    return retval;
+}
+
+// Move p_conn on to its next operation: the rest of the reply being
+// sent, else the next packet already received, else another recv.
+// Data packets wait in the append queue for uring_flush_appends().
+// Returns 0 on success, -1 on error.
+int uring_conn_continue(struct uring_server *p_server,
+			struct uring_conn *p_conn)
+{
+    struct packet_cmd cmd;
+    char *packet;
+    size_t packet_len;
+    int status;
+
+    while (!(status = uring_post_reply(p_server, p_conn))) {
+	if (!(packet = framer_next_packet(&p_conn->framer, &packet_len))) {
+	    return uring_post_recv(p_server, p_conn);
+	}
+	STATS_ADD(packets_in, 1);
+	p_conn->reply.start_ns = monotonic_ns();
+	parse_packet(packet, &cmd);
+	if (PACKET_DATA == cmd.type) {
+	    p_conn->packet = packet;
+	    p_conn->packet_len = packet_len;
+	    p_conn->next_append = NULL;
+	    *p_server->append_tail = p_conn;
+	    p_server->append_tail = &p_conn->next_append;
+	    return 0;
+	}
+	// Inline commands don't write anything, reply right away
+	if (uring_conn_capture(p_server, p_conn, &cmd)) {
+	    return -1;
+	}
+    }
+    return (status < 0) ? -1 : 0;
+}
+
+// Post a shutdown (how) of p_conn's socket, alongside whatever operation
+// it has in flight.  Returns 0 on success, -1 on error.
+int uring_post_shutdown(struct uring_server *p_server,
+			struct uring_conn *p_conn, int how)
+{
+    struct io_uring_sqe *p_sqe;
+
+    if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_SHUTDOWN, p_conn))) {
+	return -1;
+    }
+    p_sqe->opcode = IORING_OP_SHUTDOWN;
+    p_sqe->flags = IOSQE_FIXED_FILE;
+    p_sqe->fd = URING_FIRST_CONN_FILE + p_conn->slot;
+    p_sqe->len = how;
+    return 0;
+}
+
+// Post a shutdown (how) of every open connection.  Returns 0 on success,
+// -1 on error.
+int uring_shutdown_conns(struct uring_server *p_server, int how)
+{
+    int i;
+
+    for (i = 0; i < p_server->p_config->max_connections; i++) {
+	if (p_server->conns[i].is_open &&
+	    uring_post_shutdown(p_server, &p_server->conns[i], how)) {
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+// Stop accepting and drain on a signal, like thread_server_loop(): the
+// listener is shut down, failing the accepts posted on it, and so is the
+// read side of every connection, which is then answered up to what the
+// client already sent and closed as if the client had.  A timeout for
+// drain_secs (-w) catches the rest.  Returns 0 on success, -1 on error.
+int uring_start_drain(struct uring_server *p_server)
+{
+    struct io_uring_sqe *p_sqe;
+
+    PRINTF("Caught signal, draining %d connections\n", p_server->num_open);
+    p_server->draining = 1;
+    // The ring's reference to the listening socket outlives us for a
+    // moment; stop listening now so a restart can bind.
+    shutdown(p_server->listen_fd, SHUT_RDWR);
+    if (uring_shutdown_conns(p_server, SHUT_RD) ||
+	!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_DEADLINE, NULL))) {
+	return -1;
+    }
+    p_server->drain_timeout.tv_sec = p_server->p_config->drain_secs;
+    p_server->drain_timeout.tv_nsec = 0;
+    p_sqe->opcode = IORING_OP_TIMEOUT;
+    p_sqe->addr = (uintptr_t) &p_server->drain_timeout;
+    p_sqe->len = 1;
+    return 0;
+}
+
+// Free p_conn's resources and post a close of its socket.  The slot is
+// reused once the close completes.  Logs the reason from errno.
+void uring_conn_close(struct uring_server *p_server, struct uring_conn *p_conn)
+{
+    struct io_uring_sqe *p_sqe;
+
+    log_connection_closed(&p_conn->framer, p_conn->client_ip_addr_str, errno);
+    reply_free(p_server->p_datafile, &p_conn->reply);
+    framer_free(&p_conn->framer);
+    session_free(&p_conn->session);
+    p_conn->is_open = 0;
+    p_server->num_open--;
+    if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_CLOSE, p_conn))) {
+	// Leak the slot rather than reuse a socket still in the table
+	return;
+    }
+    p_sqe->opcode = IORING_OP_CLOSE;
+    p_sqe->file_index = URING_FIRST_CONN_FILE + p_conn->slot + 1;
+}
+
+// Set up the connection in the slot an accept just filled.  Returns 0
+// on success, -1 on error.
+int uring_accept_done(struct uring_server *p_server, struct uring_conn *p_conn,
+		      int res)
+{
+    p_server->accepts_posted--;
+    if (res < 0) {
+	p_server->free_slots[p_server->num_free_slots++] = p_conn->slot;
+	// Failed by uring_start_drain() shutting the listener down
+	if (p_server->draining) {
+	    return 0;
+	}
+	errno = -res;
+	perror("accept");
+	// EINVAL means the kernel can't accept into the fixed file table
+	return (EINVAL == errno) ? -1 : 0;
+    }
+
+    bzero(&p_conn->session, sizeof(struct client_session));
+    reply_init(&p_conn->reply);
+    p_conn->chunk_len = p_conn->chunk_sent = 0;
+    p_conn->is_open = 1;
+    p_server->num_open++;
+    if (client_addr_str((struct sockaddr *) &p_conn->client_addr,
+			p_conn->client_addr_len, p_conn->client_ip_addr_str,
+			p_conn->client_port_str)) {
+	perror("getnameinfo");
+	strcpy(p_conn->client_ip_addr_str, "?");
+	strcpy(p_conn->client_port_str, "?");
+    }
+    PRINTF("Accepted connection from %s:%s\n", p_conn->client_ip_addr_str,
+	   p_conn->client_port_str);
+    syslog(LOG_USER|LOG_INFO, "Accepted connection from %s",
+	   p_conn->client_ip_addr_str);
+    STATS_ADD(conns_accepted, 1);
+
+    if (framer_init(&p_conn->framer, p_server->p_config->max_packet_size,
+		    p_server->p_config->recv_buf_size) ||
+	uring_post_recv(p_server, p_conn) ||
+	// Completed just as the drain started, drain this one too
+	(p_server->draining &&
+	 uring_post_shutdown(p_server, p_conn, SHUT_RD))) {
+	uring_conn_close(p_server, p_conn);
+    }
+    return 0;
+}
+
+// Write every queued data packet to the data file with one writev SQE,
+// unless a batch is already being written.  The range is reserved under
+// the data file lock so a timestamp record appends after it.  Each
+// reply still ends with its own packet, which the char device can't do
+// for a batch, so there packets are written one at a time.  Returns 0
+// on success, -1 on error.
+int uring_flush_appends(struct uring_server *p_server)
+{
+    struct datafile *p_datafile = p_server->p_datafile;
+    struct uring_conn *p_conn, **pp_next;
+    struct io_uring_sqe *p_sqe;
+    int num_iov;
+    off_t offset;
+
+    if (p_server->append_batch || !p_server->append_head) {
+	return 0;
+    }
+
+    // Each packet takes two iovecs, itself and its newline
+    p_server->append_batch = p_server->append_head;
+    p_server->append_len = 0;
+    num_iov = 0;
+    for (pp_next = &p_server->append_head;
+	 *pp_next && (num_iov + 2 <= IOV_MAX) &&
+	     (p_datafile->is_regular || !num_iov);
+	 pp_next = &(*pp_next)->next_append) {
+	p_server->append_iov[num_iov].iov_base = (*pp_next)->packet;
+	p_server->append_iov[num_iov++].iov_len = (*pp_next)->packet_len;
+	p_server->append_iov[num_iov].iov_base = "\n";
+	p_server->append_iov[num_iov++].iov_len = 1;
+	p_server->append_len += (*pp_next)->packet_len + 1;
+    }
+    p_server->append_head = *pp_next;
+    *pp_next = NULL;
+    if (!p_server->append_head) {
+	p_server->append_tail = &p_server->append_head;
+    }
+
+    if (datafile_rwlock(p_datafile, 1)) {
+	return -1;
+    }
+    // The char device appends wherever it's written.  The regular file
+    // range only becomes readable (committed) in uring_append_done().
+    offset = -1;
+    if (p_datafile->is_regular) {
+	offset = p_datafile->size;
+	for (p_conn = p_server->append_batch; p_conn;
+	     p_conn = p_conn->next_append) {
+	    p_datafile->size += p_conn->packet_len + 1;
+	    p_conn->append_end = p_datafile->size;
+	}
+    }
+    if (pthread_rwlock_unlock(&p_datafile->lock)) {
+	perror("pthread_rwlock_unlock");
+	return -1;
+    }
+
+    if (!(p_sqe = uring_get_sqe(&p_server->ring, URING_OP_APPEND, NULL))) {
+	return -1;
+    }
+    p_sqe->opcode = IORING_OP_WRITEV;
+    p_sqe->flags = IOSQE_FIXED_FILE;
+    p_sqe->fd = URING_DATAFILE_FILE;
+    p_sqe->addr = (uintptr_t) p_server->append_iov;
+    p_sqe->len = num_iov;
+    p_sqe->off = offset;
+    p_server->append_offset = offset;
+    return 0;
+}
+
+// Give back the unwritten end [start, end) of a regular file range
+// reserved by uring_flush_appends(), moving whatever has been appended
+// after it (timestamps) down over it, so the file doesn't keep a hole
+// of NULs.  Must be called with the data file lock held exclusively.
+// Returns 0 on success, -1 on error.
+int datafile_unreserve(struct datafile *p_datafile, off_t start, off_t end)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    int file_fd, retval = -1;
+
+    if (-1 == (file_fd = datafile_get_fd(p_datafile))) {
+	return -1;
+    }
+    if ((end < p_datafile->size) &&
+	read_data_range(file_fd, end, p_datafile->size, &buf, &len)) {
+	goto put_fd;
+    }
+    if (len && (pwrite(file_fd, buf, len, start) != (ssize_t) len)) {
+	perror("pwrite");
+	goto put_fd;
+    }
+    p_datafile->size = start + len;
+    if (ftruncate(file_fd, p_datafile->size)) {
+	perror("ftruncate");
+	goto put_fd;
+    }
+    retval = 0;
+
+put_fd:
+    free(buf);
+    datafile_put_fd(p_datafile, file_fd);
+    return retval;
+}
+
+// Make the regular file range of the append batch that completed with
+// res readable, giving back whatever wasn't written.  Returns the end
+// of what was, or -1 on error.
+off_t uring_append_commit(struct uring_server *p_server, int res)
+{
+    struct datafile *p_datafile = p_server->p_datafile;
+    off_t written_end, retval;
+
+    written_end = p_server->append_offset + ((res > 0) ? res : 0);
+    if (datafile_rwlock(p_datafile, 1)) {
+	return -1;
+    }
+    retval = written_end;
+    if ((written_end < p_server->append_offset +
+	 (off_t) p_server->append_len) &&
+	datafile_unreserve(p_datafile, written_end,
+			   p_server->append_offset + p_server->append_len)) {
+	retval = -1;
+    }
+    p_datafile->committed = p_datafile->size;
+    if (pthread_rwlock_unlock(&p_datafile->lock)) {
+	perror("pthread_rwlock_unlock");
+	return -1;
+    }
+    return retval;
+}
+
+// Capture the replies for a batch of data packets whose append has
+// completed, once its range is committed, and move each connection on.
+void uring_append_done(struct uring_server *p_server, int res)
+{
+    struct uring_conn *p_conn, *p_next;
+    struct packet_cmd cmd;
+    off_t written_end = 0;
+    int error = 0;
 
-    // File open/close pairing moved to threads in assignment 8
-    // so mod unload in QEMU will work.  Instead, delete old local
-    // file if not using aesdchar device.
-#ifndef USE_AESD_CHAR_DEVICE
-    unlink(DATAFILE_NAME);
+    if (res < 0) {
+	error = -res;
+	errno = error;
+	perror("writev");
+    } else if ((size_t) res != p_server->append_len) {
+	// Replies stop short, like datafile_append() (fs full)
+	PRINTF("Short append, %d of %zu bytes\n", res, p_server->append_len);
+    }
+    if (p_server->p_datafile->is_regular &&
+	(-1 == (written_end = uring_append_commit(p_server, res))) &&
+	!error) {
+	error = errno ? errno : EIO;
+    }
+
+    bzero(&cmd, sizeof(struct packet_cmd));
+    cmd.type = PACKET_DATA;
+    for (p_conn = p_server->append_batch; p_conn; p_conn = p_next) {
+	p_next = p_conn->next_append;
+	cmd.append_end = (p_server->p_datafile->is_regular &&
+			  (written_end < p_conn->append_end)) ?
+	    written_end : p_conn->append_end;
+	errno = error;
+	if (error || uring_conn_capture(p_server, p_conn, &cmd) ||
+	    uring_conn_continue(p_server, p_conn)) {
+	    uring_conn_close(p_server, p_conn);
+	}
+    }
+    p_server->append_batch = NULL;
+}
+
+// Handle a completion for an operation on p_conn.  Returns 0 on
+// success, -1 if the connection should be closed (errno set).
+int uring_conn_done(struct uring_server *p_server, struct uring_conn *p_conn,
+		    enum uring_op op, int res)
+{
+    if (res < 0) {
+	errno = -res;
+	perror((URING_OP_RECV == op) ? "recv" :
+	       (URING_OP_READ == op) ? "read" :
+	       (URING_OP_SPLICE == op) ? "splice" : "send");
+	return -1;
+    }
+
+    switch (op) {
+    case URING_OP_RECV:
+	if (0 == res) {
+	    // Remote connection closed
+	    errno = 0;
+	    return -1;
+	}
+	framer_commit(&p_conn->framer, res);
+	break;
+    case URING_OP_READ:
+	if (0 == res) {
+	    // File is shorter than expected, nothing more to send
+	    p_conn->reply.offset = p_conn->reply.end;
+	}
+	p_conn->reply.offset += res;
+	p_conn->chunk_len = res;
+	p_conn->chunk_sent = 0;
+	break;
+    case URING_OP_SEND:
+	if (p_conn->chunk_sent < p_conn->chunk_len) {
+	    p_conn->chunk_sent += res;
+	} else {
+	    p_conn->reply.sent += res;
+	}
+	STATS_ADD(bytes_out, res);
+	break;
+    case URING_OP_SPLICE:
+	if (0 == res) {
+	    errno = EPIPE;
+	    return -1;
+	}
+	p_conn->reply.pipe_len -= res;
+	STATS_ADD(bytes_out, res);
+	break;
+    default:
+	break;
+    }
+    return uring_conn_continue(p_server, p_conn);
+}
+
+// Event loop for SERVER_MODE_URING.  A single thread drives accept,
+// recv, the data file appends and reply reads, and the sends as
+// io_uring operations, with the listening socket, data file and client
+// sockets in the fixed file table and each connection's reply buffer
+// registered.  On a signal, drains, see uring_start_drain().  Returns 0
+// after draining on a signal, -1 on error.
+int uring_server_loop(int sock_fd, struct datafile *p_datafile,
+		      const struct server_config *p_config)
+{
+    int max_conns = p_config->max_connections;
+    size_t chunk_size = p_config->uring_chunk_size;
+    struct uring_server *p_server;
+    struct uring *p_ring;
+    struct io_uring_cqe *p_cqe;
+    struct uring_conn *p_conn;
+    struct iovec *p_buffers;
+    int *p_files;
+    char *chunk_pool;
+    unsigned head;
+    uint64_t user_data;
+    int i, res;
+
+    if (!(p_server = calloc(1, sizeof(struct uring_server))) ||
+	!(p_server->conns = calloc(max_conns,
+				   sizeof(struct uring_conn))) ||
+	!(p_server->free_slots = calloc(max_conns, sizeof(int))) ||
+	!(p_files = calloc(URING_FIRST_CONN_FILE + max_conns,
+			   sizeof(int))) ||
+	!(p_buffers = calloc(max_conns, sizeof(struct iovec))) ||
+	!(chunk_pool = malloc((size_t) max_conns * chunk_size))) {
+	perror("calloc");
+	return -1;
+    }
+    p_ring = &p_server->ring;
+    p_server->p_datafile = p_datafile;
+    p_server->p_config = p_config;
+    p_server->append_tail = &p_server->append_head;
+    p_server->listen_fd = sock_fd;
+
+    // Every connection slot has at most one operation in flight (an
+    // accept, close or I/O), plus the append, the timer and signal
+    // polls and the drain timeout; the CQ is twice the SQ, leaving room
+    // for a shutdown per connection while draining.
+    if (uring_init(p_ring, max_conns + 5)) {
+	return -1;
+    }
+
+    // Hand out slot 0 first
+    for (i = 0; i < max_conns; i++) {
+	p_server->conns[i].slot = i;
+	p_server->conns[i].chunk = chunk_pool + i * chunk_size;
+	p_server->free_slots[max_conns - 1 - i] = i;
+	p_buffers[i].iov_base = p_server->conns[i].chunk;
+	p_buffers[i].iov_len = chunk_size;
+    }
+    p_server->num_free_slots = max_conns;
+
+    // Client sockets fill in the -1 entries as they're accepted
+    p_files[URING_LISTEN_FILE] = sock_fd;
+    p_files[URING_DATAFILE_FILE] = p_datafile->fd;
+    for (i = URING_FIRST_CONN_FILE; i < URING_FIRST_CONN_FILE + max_conns;
+	 i++) {
+	p_files[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, p_ring->ring_fd, IORING_REGISTER_FILES,
+		p_files, URING_FIRST_CONN_FILE + max_conns)) {
+	perror("io_uring_register files");
+	return -1;
+    }
+    free(p_files);
+
+    // Registered buffers are pinned and count against RLIMIT_MEMLOCK;
+    // without them replies use plain reads into the same buffers.
+    if (syscall(__NR_io_uring_register, p_ring->ring_fd,
+		IORING_REGISTER_BUFFERS, p_buffers, max_conns)) {
+	perror("io_uring_register buffers");
+    } else {
+	p_server->buffers_registered = 1;
+    }
+    free(p_buffers);
+
+    if (uring_post_timer(p_server) ||
+	uring_post_poll(p_server, URING_OP_SIGNAL, signal_fd)) {
+	return -1;
+    }
+
+    while (!p_server->draining || p_server->num_open ||
+	   p_server->accepts_posted) {
+	if (uring_post_accepts(p_server) || uring_flush_appends(p_server)) {
+	    return -1;
+	}
+
+	(void) uring_submit(p_ring, 1);
+
+	// Completions become visible with the tail; release each CQE as
+	// soon as it's been read.
+	head = *p_ring->cq_head;
+	while (head != __atomic_load_n(p_ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	    p_cqe = &p_ring->cqes[head & *p_ring->cq_mask];
+	    user_data = p_cqe->user_data;
+	    res = p_cqe->res;
+	    __atomic_store_n(p_ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+	    p_conn = (struct uring_conn *) (uintptr_t)
+		(user_data & ~(uint64_t) URING_OP_MASK);
+	    switch (user_data & URING_OP_MASK) {
+	    case URING_OP_ACCEPT:
+		if (uring_accept_done(p_server, p_conn, res)) {
+		    return -1;
+		}
+		break;
+	    case URING_OP_APPEND:
+		uring_append_done(p_server, res);
+		break;
+	    case URING_OP_CLOSE:
+		p_server->free_slots[p_server->num_free_slots++] = p_conn->slot;
+		break;
+	    case URING_OP_TIMER:
+		if (res < 0) {
+		    errno = -res;
+		    perror("poll timerfd");
+		    break;
+		}
+		(void) timestamp_timer_fire();
+		if (uring_post_timer(p_server)) {
+		    return -1;
+		}
+		break;
+	    case URING_OP_SIGNAL:
+		if (res < 0) {
+		    errno = -res;
+		    perror("poll signalfd");
+		    return -1;
+		}
+		if (uring_start_drain(p_server)) {
+		    return -1;
+		}
+		break;
+	    case URING_OP_SHUTDOWN:
+		// The connection may have closed first
+		if ((res < 0) && (-ENOTCONN != res) && (-EBADF != res)) {
+		    errno = -res;
+		    perror("shutdown");
+		}
+		break;
+	    case URING_OP_DEADLINE:
+		// Out of time.  Shutting down the write side too fails any
+		// reply still waiting to be sent, so the rest close promptly.
+		syslog(LOG_USER|LOG_WARNING,
+		       "%d connections still busy after %d s, closing them",
+		       p_server->num_open, p_config->drain_secs);
+		if (uring_shutdown_conns(p_server, SHUT_RDWR)) {
+		    return -1;
+		}
+		break;
+	    default:
+		if (uring_conn_done(p_server, p_conn,
+				    user_data & URING_OP_MASK, res)) {
+		    uring_conn_close(p_server, p_conn);
+		}
+		break;
+	    }
+	}
+    }
+    return 0;
+}
+#endif // USE_IO_URING
+
+// Serve one connection for a SERVER_MODE_POOL worker thread, listed
+// as active meanwhile, then close it and give back its slot.
+void pool_serve_client(struct conn_queue *p_queue,
+		       struct server_thread_data *p_thread_data)
+{
+    pthread_mutex_lock(&p_queue->lock);
+    LIST_INSERT_HEAD(&p_queue->active, p_thread_data, entries);
+    // Accepted after main shut down the others, drain this one too
+    if (p_queue->draining) {
+	shutdown(p_thread_data->conn_fd, SHUT_RD);
+    }
+    pthread_mutex_unlock(&p_queue->lock);
+
+    serve_client(p_thread_data);
+
+    // Off the list before the fd can be reused
+    pthread_mutex_lock(&p_queue->lock);
+    LIST_REMOVE(p_thread_data, entries);
+    pthread_mutex_unlock(&p_queue->lock);
+    close(p_thread_data->conn_fd);
+    free(p_thread_data);
+    conn_slot_release();
+}
+
+// Count a SERVER_MODE_POOL worker thread out, for pool_drain().
+void *pool_thread_exit(struct conn_queue *p_queue, void *retval)
+{
+    pthread_mutex_lock(&p_queue->lock);
+    p_queue->num_workers--;
+    pthread_cond_signal(&p_queue->worker_done);
+    pthread_mutex_unlock(&p_queue->lock);
+    return retval;
+}
+
+// Worker thread for SERVER_MODE_POOL.  Serves queued connections one at
+// a time, until the queue is empty once the pool is draining.
+void *pool_thread(void *arg)
+{
+    struct conn_queue *p_queue = (struct conn_queue *) arg;
+    struct server_thread_data *p_thread_data;
+
+    if (block_server_signals()) {
+	return pool_thread_exit(p_queue, arg);
+    }
+    while (1) {
+	pthread_mutex_lock(&p_queue->lock);
+	while (!p_queue->count && !p_queue->draining) {
+	    pthread_cond_wait(&p_queue->not_empty, &p_queue->lock);
+	}
+	if (!p_queue->count) {
+	    pthread_mutex_unlock(&p_queue->lock);
+	    break;
+	}
+	p_thread_data = p_queue->entries[p_queue->head];
+	p_queue->head = (p_queue->head + 1) % p_queue->capacity;
+	p_queue->count--;
+	pthread_mutex_unlock(&p_queue->lock);
+
+	pool_serve_client(p_queue, p_thread_data);
+    }
+    return pool_thread_exit(p_queue, arg);
+}
+
+// Worker thread for SERVER_MODE_POOL with -P.  Accepts on its own
+// SO_REUSEPORT listener and serves one connection at a time, so clients
+// wait in the listen backlog rather than the pool's queue (-q doesn't
+// apply).  The kernel picks the listener by hashing the client's
+// address, not by which thread is idle, so a long lived client holds up
+// whoever lands on its thread's listener; -m epoll -P doesn't have that
+// problem.  Exits once main shuts the listener down to drain.
+void *pool_accept_thread(void *arg)
+{
+    struct pool_listener *p_listener = (struct pool_listener *) arg;
+    struct conn_queue *p_queue = p_listener->p_queue;
+    struct server_thread_data *p_thread_data;
+    int draining;
+
+    if (block_server_signals()) {
+	return pool_thread_exit(p_queue, arg);
+    }
+    while (1) {
+	if (!(p_thread_data = calloc(1, sizeof(struct server_thread_data)))) {
+	    perror("calloc");
+	    break;
+	}
+	if (conn_slot_acquire()) {
+	    // EINTR is the signal that starts the drain
+	    if (EINTR != errno) {
+		perror("read eventfd");
+	    }
+	    free(p_thread_data);
+	    break;
+	}
+	if (-1 == (p_thread_data->conn_fd =
+		   accept_client(p_listener->listen_fd,
+				 p_thread_data->client_ip_addr_str,
+				 p_thread_data->client_port_str))) {
+	    free(p_thread_data);
+	    conn_slot_release();
+	    pthread_mutex_lock(&p_queue->lock);
+	    draining = p_queue->draining;
+	    pthread_mutex_unlock(&p_queue->lock);
+	    if (draining) {
+		break;
+	    }
+	    // The client gave up already
+	    if ((ECONNABORTED == errno) || (EINTR == errno) ||
+		(EINVAL == errno)) {
+		continue;
+	    }
+	    perror("accept");
+	    break;
+	}
+	p_thread_data->p_datafile = p_listener->p_datafile;
+	p_thread_data->p_config = p_listener->p_config;
+
+	pool_serve_client(p_queue, p_thread_data);
+    }
+    return pool_thread_exit(p_queue, arg);
+}
+
+// Shut down (how) every connection the pool is serving or has queued.
+// Must be called with the queue lock held.
+void pool_shutdown_conns(struct conn_queue *p_queue, int how)
+{
+    struct server_thread_data *p_thread_data;
+    int i;
+
+    LIST_FOREACH(p_thread_data, &p_queue->active, entries) {
+	shutdown(p_thread_data->conn_fd, how);
+    }
+    for (i = 0; i < p_queue->count; i++) {
+	shutdown(p_queue->entries[(p_queue->head + i) %
+				  p_queue->capacity]->conn_fd, how);
+    }
+}
+
+// Drain SERVER_MODE_POOL on a signal, once main has stopped accepting:
+// shut down the read side of every connection being served or queued,
+// so each is answered up to what it has already sent, and wait for the
+// workers to run out of connections.  Connections still busy after
+// drain_secs (-w) are shut down outright, like thread_server_loop().
+// Returns once every worker has exited.
+void pool_drain(struct conn_queue *p_queue, int drain_secs)
+{
+    struct timespec deadline;
+    int timed_out = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += drain_secs;
+    pthread_mutex_lock(&p_queue->lock);
+    PRINTF("Caught signal, draining %d pool threads\n", p_queue->num_workers);
+    p_queue->draining = 1;
+    pthread_cond_broadcast(&p_queue->not_empty);
+    pool_shutdown_conns(p_queue, SHUT_RD);
+    while (p_queue->num_workers && !timed_out) {
+	timed_out = (ETIMEDOUT ==
+		     pthread_cond_timedwait(&p_queue->worker_done,
+					    &p_queue->lock, &deadline));
+    }
+    if (p_queue->num_workers) {
+	// Out of time.  Shutting down the write side too fails any reply
+	// still blocked in send, so the rest exit promptly.
+	syslog(LOG_USER|LOG_WARNING,
+	       "%d pool threads still busy after %d s, closing connections",
+	       p_queue->num_workers, drain_secs);
+	pool_shutdown_conns(p_queue, SHUT_RDWR);
+    }
+    while (p_queue->num_workers) {
+	pthread_cond_wait(&p_queue->worker_done, &p_queue->lock);
+    }
+    pthread_mutex_unlock(&p_queue->lock);
+}
+
+// Set up the queue (and active list) for SERVER_MODE_POOL with
+// num_workers threads about to start.  worker_done waits on the
+// monotonic clock, for pool_drain()'s deadline.  Returns 0 on success,
+// -1 on error.
+int pool_queue_init(struct conn_queue *p_queue, int capacity,
+		    int num_workers)
+{
+    pthread_condattr_t cond_attr;
+
+    bzero(p_queue, sizeof(struct conn_queue));
+    LIST_INIT(&p_queue->active);
+    p_queue->num_workers = num_workers;
+    p_queue->capacity = capacity;
+    if (capacity &&
+	!(p_queue->entries = calloc(capacity,
+				    sizeof(struct server_thread_data *)))) {
+	perror("calloc");
+	return -1;
+    }
+    if (pthread_condattr_init(&cond_attr) ||
+	pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) ||
+	pthread_mutex_init(&p_queue->lock, NULL) ||
+	pthread_cond_init(&p_queue->not_empty, NULL) ||
+	pthread_cond_init(&p_queue->worker_done, &cond_attr)) {
+	perror("pthread_mutex_init");
+	return -1;
+    }
+    pthread_condattr_destroy(&cond_attr);
+    return 0;
+}
+
+// Accept loop for SERVER_MODE_POOL.  Starts num_threads worker threads
+// and queues accepted connections for them, up to queue_len waiting.
+// Past that the server is saturated and new connections are closed
+// right away rather than piling up.  With -P the threads accept for
+// themselves instead, see pool_accept_thread().  On a signal, stops
+// accepting and drains, see pool_drain().  Returns 0 after draining on
+// a signal, -1 on error.
+int pool_server_loop(int sock_fd, struct datafile *p_datafile,
+		     const struct server_config *p_config)
+{
+    int num_threads = p_config->num_threads;
+    int queue_len = p_config->pool_queue_len;
+    struct server_thread_data *p_thread_data;
+    struct pool_listener *p_listeners;
+    struct conn_queue queue;
+    pthread_attr_t thread_attr;
+    pthread_t thread_id;
+    int i;
+
+    if (pool_queue_init(&queue, p_config->reuseport ? 0 : queue_len,
+			num_threads) ||
+	server_thread_attr_init(&thread_attr)) {
+	return -1;
+    }
+
+    if (p_config->reuseport) {
+	if (!(p_listeners = calloc(num_threads, sizeof(struct pool_listener)))) {
+	    perror("calloc");
+	    return -1;
+	}
+	for (i = 0; i < num_threads; i++) {
+	    // Thread 0 takes over main's listener, the rest get their own
+	    p_listeners[i].listen_fd = i ? socket_init(p_config->port,
+						       p_config->listen_backlog,
+						       1) : sock_fd;
+	    p_listeners[i].p_datafile = p_datafile;
+	    p_listeners[i].p_config = p_config;
+	    p_listeners[i].p_queue = &queue;
+	    if (pthread_create(&p_listeners[i].thread_id, &thread_attr,
+			       pool_accept_thread, (void *) &p_listeners[i])) {
+		perror("pthread_create");
+		return -1;
+	    }
+	}
+	pthread_attr_destroy(&thread_attr);
+	PRINTF("Started %d pool threads with their own listeners\n",
+	       num_threads);
+	if (wait_for_signal()) {
+	    return -1;
+	}
+	// Wakes every thread blocked in accept (with EINVAL), which
+	// then sees draining and exits
+	pthread_mutex_lock(&queue.lock);
+	queue.draining = 1;
+	pthread_mutex_unlock(&queue.lock);
+	for (i = 0; i < num_threads; i++) {
+	    shutdown(p_listeners[i].listen_fd, SHUT_RDWR);
+	}
+	pool_drain(&queue, p_config->drain_secs);
+	return 0;
+    }
+
+    for (i = 0; i < num_threads; i++) {
+	if (pthread_create(&thread_id, &thread_attr, pool_thread,
+			   (void *) &queue)) {
+	    perror("pthread_create");
+	    return -1;
+	}
+    }
+    pthread_attr_destroy(&thread_attr);
+    PRINTF("Started %d pool threads\n", num_threads);
+
+    while (1) {
+	if (!(p_thread_data = calloc(1, sizeof(struct server_thread_data)))) {
+	    perror("calloc");
+	    return -1;
+	}
+	if (-1 == (p_thread_data->conn_fd =
+		   wait_for_client_connection(sock_fd,
+					      p_thread_data->client_ip_addr_str,
+					      p_thread_data->client_port_str))) {
+	    free(p_thread_data);
+	    if (EINTR == errno) {
+		break;
+	    }
+	    return -1;
+	}
+	p_thread_data->p_datafile = p_datafile;
+	p_thread_data->sock_fd = sock_fd;
+	p_thread_data->p_config = p_config;
+
+	pthread_mutex_lock(&queue.lock);
+	if (queue.count == queue.capacity) {
+	    pthread_mutex_unlock(&queue.lock);
+	    syslog(LOG_USER|LOG_WARNING,
+		   "Server busy, rejecting connection from %s",
+		   p_thread_data->client_ip_addr_str);
+	    STATS_ADD(conns_rejected, 1);
+	    STATS_ADD(conns_closed, 1);
+	    shutdown(p_thread_data->conn_fd, SHUT_RDWR);
+	    close(p_thread_data->conn_fd);
+	    free(p_thread_data);
+	    conn_slot_release();
+	    continue;
+	}
+	queue.entries[(queue.head + queue.count) % queue.capacity] =
+	    p_thread_data;
+	queue.count++;
+	pthread_cond_signal(&queue.not_empty);
+	pthread_mutex_unlock(&queue.lock);
+    }
+
+    shutdown(sock_fd, SHUT_RDWR);
+    pool_drain(&queue, p_config->drain_secs);
+    return 0;
+}
+
+// Command line options.  Each long option is also a key for config
+// files (-C), see config_load().
+//   -C <file>        read settings from file; later options override it
+//   -d               run as a daemon
+//   -m thread|epoll|uring|pool  connection handling mode (default thread)
+//   -t <n>           epoll event loop threads (default one per core)
+//                    or pool threads (default 8 per core)
+//   -r               reopen the data file for every access (default
+//                    for /dev/aesdchar, so the module can be unloaded)
+//   -M <bytes>       longest packet accepted, 0 for no limit
+//   -c <n>           most connections served at once, 0 for no limit
+//                    (uring: default 256)
+//   -b <n>           listen backlog
+//   -q <n>           pool connections queued before rejecting more
+//   -w <secs>        time to drain connections on SIGINT/SIGTERM
+//   -T <ms>          timestamp interval, 0 for none (default 10 s for
+//                    the data file, none for /dev/aesdchar)
+//   -p <port>        TCP port to listen on
+//   -P               epoll, pool: each thread accepts on its own
+//                    SO_REUSEPORT listener
+//   -B aesdchar|file data file backend
+//   -f <path>        data file (default depends on the backend)
+//   -R <bytes>       initial receive buffer per connection
+//   -U <bytes>       uring: reply buffer per connection
+const struct option long_options[] = {
+    {"config",			required_argument, NULL, 'C'},
+    {"daemon",			no_argument,       NULL, 'd'},
+    {"mode",			required_argument, NULL, 'm'},
+    {"threads",			required_argument, NULL, 't'},
+    {"reopen",			no_argument,       NULL, 'r'},
+    {"max-packet",		required_argument, NULL, 'M'},
+    {"max-connections",		required_argument, NULL, 'c'},
+    {"backlog",			required_argument, NULL, 'b'},
+    {"queue",			required_argument, NULL, 'q'},
+    {"drain-timeout",		required_argument, NULL, 'w'},
+    {"timestamp-interval",	required_argument, NULL, 'T'},
+    {"port",			required_argument, NULL, 'p'},
+    {"reuseport",		no_argument,       NULL, 'P'},
+    {"backend",			required_argument, NULL, 'B'},
+    {"datafile",		required_argument, NULL, 'f'},
+    {"recv-buffer",		required_argument, NULL, 'R'},
+    {"uring-chunk",		required_argument, NULL, 'U'},
+    {NULL, 0, NULL, 0}
+};
+#define SHORT_OPTIONS	"C:dm:t:rM:c:b:q:w:T:p:PB:f:R:U:"
+
+// Fill in the compiled in defaults.  Anything that depends on other
+// settings is left 0/-1/empty for config_finish().
+void config_defaults(struct server_config *p_config)
+{
+    bzero(p_config, sizeof(struct server_config));
+    p_config->mode = SERVER_MODE_THREAD;
+    strcpy(p_config->port, TCP_PORT);
+    p_config->listen_backlog = SOCKET_LISTEN_BACKLOG;
+#ifdef USE_AESD_CHAR_DEVICE
+    p_config->backend = BACKEND_AESDCHAR;
+#else
+    p_config->backend = BACKEND_FILE;
 #endif // USE_AESD_CHAR_DEVICE
+    p_config->pool_queue_len = POOL_QUEUE_LEN;
+    p_config->max_packet_size = MAX_PACKET_SIZE;
+    p_config->recv_buf_size = SOCK_READ_BUF_SIZE;
+    p_config->uring_chunk_size = URING_CHUNK_SIZE;
+    p_config->drain_secs = DRAIN_TIMEOUT_SECS;
+    p_config->timestamp_ms = -1;
+    p_config->reopen_datafile = -1;
+}
+
+// Apply one option, given as its short option character.  value is
+// NULL for a flag on the command line; in a config file a flag can be
+// turned off with 0, no, false or off.  Bad values get a message and
+// are ignored, like unknown options.
+void config_set(struct server_config *p_config, int opt, const char *value)
+{
+    int flag = !value || (strcmp(value, "0") && strcasecmp(value, "no") &&
+			  strcasecmp(value, "false") &&
+			  strcasecmp(value, "off"));
+
+    switch (opt)
+    {
+    case 'd':
+	p_config->daemonize = flag;
+	break;
+    case 'm':
+	if (!strcmp(value, "epoll")) {
+	    p_config->mode = SERVER_MODE_EPOLL;
+	} else if (!strcmp(value, "uring")) {
+#ifdef USE_IO_URING
+	    p_config->mode = SERVER_MODE_URING;
+#else
+	    fprintf(stderr, "uring mode not built, using thread\n");
+#endif // USE_IO_URING
+	} else if (!strcmp(value, "pool")) {
+	    p_config->mode = SERVER_MODE_POOL;
+	} else if (!strcmp(value, "thread")) {
+	    p_config->mode = SERVER_MODE_THREAD;
+	} else {
+	    fprintf(stderr, "Unknown mode %s, using thread\n", value);
+	}
+	break;
+    case 't':
+	p_config->num_threads = atoi(value);
+	break;
+    case 'r':
+	p_config->reopen_datafile = flag;
+	break;
+    case 'M':
+	p_config->max_packet_size = strtoul(value, NULL, 0);
+	break;
+    case 'c':
+	p_config->max_connections = atoi(value);
+	break;
+    case 'b':
+	p_config->listen_backlog = atoi(value);
+	break;
+    case 'q':
+	p_config->pool_queue_len = atoi(value);
+	break;
+    case 'w':
+	p_config->drain_secs = atoi(value);
+	break;
+    case 'T':
+	p_config->timestamp_ms = strtol(value, NULL, 0);
+	break;
+    case 'p':
+	if (strlen(value) >= sizeof(p_config->port)) {
+	    fprintf(stderr, "Port %s too long, ignoring\n", value);
+	} else {
+	    strcpy(p_config->port, value);
+	}
+	break;
+    case 'P':
+	p_config->reuseport = flag;
+	break;
+    case 'B':
+	if (!strcmp(value, "aesdchar")) {
+	    p_config->backend = BACKEND_AESDCHAR;
+	} else if (!strcmp(value, "file")) {
+	    p_config->backend = BACKEND_FILE;
+	} else {
+	    fprintf(stderr, "Unknown backend %s, ignoring\n", value);
+	}
+	break;
+    case 'f':
+	if (strlen(value) >= sizeof(p_config->datafile_name)) {
+	    fprintf(stderr, "Data file name too long, ignoring\n");
+	} else {
+	    strcpy(p_config->datafile_name, value);
+	}
+	break;
+    case 'R':
+	p_config->recv_buf_size = strtoul(value, NULL, 0);
+	break;
+    case 'U':
+	p_config->uring_chunk_size = strtoul(value, NULL, 0);
+	break;
+    // Ignore unknown opts and errors
+    case '?':
+    default:
+	break;
+    }
+}
+
+// Read settings from a config file, one "key = value" per line, where
+// key is a long option name (a flag can appear without a value).
+// Blank lines and anything after a '#' are ignored.  Returns 0 on
+// success, -1 if the file can't be read or has an unknown key.
+int config_load(struct server_config *p_config, const char *path)
+{
+    const struct option *p_option;
+    char *line = NULL, *key, *value, *end;
+    size_t line_size = 0;
+    int line_num = 0, retval = 0;
+    FILE *file;
+
+    if (!(file = fopen(path, "r"))) {
+	perror(path);
+	return -1;
+    }
+    while (-1 != getline(&line, &line_size, file)) {
+	line_num++;
+	*strchrnul(line, '#') = 0;
+	key = line + strspn(line, " \t\r\n");
+	if (!*key) {
+	    continue;
+	}
+	// Split at '=' and trim the whitespace around both halves
+	value = strchr(key, '=');
+	if (value) {
+	    *value++ = 0;
+	    value += strspn(value, " \t");
+	}
+	for (end = key + strcspn(key, " \t\r\n"); *end; end++) {
+	    *end = 0;
+	}
+	if (value) {
+	    for (end = value + strlen(value);
+		 (end > value) && strchr(" \t\r\n", end[-1]); end--) {
+		end[-1] = 0;
+	    }
+	}
+
+	for (p_option = long_options; p_option->name; p_option++) {
+	    if (!strcmp(p_option->name, key)) {
+		break;
+	    }
+	}
+	if (!p_option->name || ('C' == p_option->val) ||
+	    ((required_argument == p_option->has_arg) && !value)) {
+	    fprintf(stderr, "%s:%d: bad setting %s\n", path, line_num, key);
+	    retval = -1;
+	    break;
+	}
+	config_set(p_config, p_option->val, value);
+    }
+    free(line);
+    fclose(file);
+    return retval;
+}
+
+// Work out settings that depend on others, and clamp the rest to
+// something usable.
+void config_finish(struct server_config *p_config)
+{
+    if (!p_config->datafile_name[0]) {
+	strcpy(p_config->datafile_name,
+	       (BACKEND_AESDCHAR == p_config->backend) ?
+	       AESDCHAR_NAME : DATAFILE_NAME);
+    }
+    if (p_config->max_connections < 0) {
+	p_config->max_connections = 0;
+    }
+    if (p_config->pool_queue_len < 1) {
+	p_config->pool_queue_len = 1;
+    }
+    if (p_config->drain_secs < 0) {
+	p_config->drain_secs = 0;
+    }
+    if (!p_config->recv_buf_size) {
+	p_config->recv_buf_size = SOCK_READ_BUF_SIZE;
+    }
+    if (!p_config->uring_chunk_size ||
+	(p_config->uring_chunk_size > INT_MAX)) {
+	p_config->uring_chunk_size = URING_CHUNK_SIZE;
+    }
+    if (p_config->timestamp_ms < 0) {
+	// The char device keeps exactly what clients write unless asked
+	p_config->timestamp_ms = (BACKEND_FILE == p_config->backend) ?
+	    TIMESTAMP_INTERVAL_MS : 0;
+    }
+
+    if (p_config->num_threads < 1) {
+	p_config->num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (SERVER_MODE_POOL == p_config->mode) {
+	    p_config->num_threads *= POOL_THREADS_PER_CPU;
+	}
+    }
+    if (p_config->reuseport && (SERVER_MODE_EPOLL != p_config->mode) &&
+	(SERVER_MODE_POOL != p_config->mode)) {
+	fprintf(stderr, "-P only applies to epoll and pool modes, ignoring\n");
+	p_config->reuseport = 0;
+    }
+    if (SERVER_MODE_URING == p_config->mode) {
+	// The uring loop has a fixed set of connection slots, and keeps
+	// the data file in its fixed file table
+	if (!p_config->max_connections) {
+	    p_config->max_connections = URING_MAX_CONNS;
+	}
+	if (p_config->reopen_datafile > 0) {
+	    fprintf(stderr, "-r not supported in uring mode, ignoring\n");
+	}
+	p_config->reopen_datafile = 0;
+    }
+    if (p_config->reopen_datafile < 0) {
+	// Holding /dev/aesdchar open would keep the module from unloading
+	p_config->reopen_datafile = (BACKEND_AESDCHAR == p_config->backend);
+    }
+}
+
+// Build the configuration from the defaults, then any config files
+// named with -C, then the rest of the command line, so the command line
+// always wins.  Returns 0 on success, -1 on a bad config file.
+int config_parse(struct server_config *p_config, int argc, char *argv[])
+{
+    int arg;
+
+    config_defaults(p_config);
+    opterr = 0;			// Turn off getopt printfs
+
+    // See: https://www.gnu.org/software/libc/manual/html_node/Getopt-Long-Options.html
+    while ((arg = getopt_long(argc, argv, SHORT_OPTIONS, long_options,
+			      NULL)) != -1) {
+	if (('C' == arg) && config_load(p_config, optarg)) {
+	    return -1;
+	}
+    }
+    optind = 0;			// Rescan from the start
+    while ((arg = getopt_long(argc, argv, SHORT_OPTIONS, long_options,
+			      NULL)) != -1) {
+	if ('C' != arg) {
+	    config_set(p_config, arg, optarg);
+	}
+    }
+    config_finish(p_config);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int sock_fd=0;
+    struct server_config config;
+    pthread_attr_t thread_attr;
+    struct datafile datafile;
+    int loop_status;
+    int exit_status = EXIT_FAILURE; // Fail by default
+
+    // Nothing to clean up in datafile until datafile_init()
+    bzero(&datafile, sizeof(struct datafile));
+
+    // Settings from the command line and config files.  Read them all
+    // before touching the socket, since they can change the port.
+    if (config_parse(&config, argc, argv)) {
+	exit(EXIT_FAILURE);
+    }
 
     // Connect SIGINT and SIGTERM - perror and exit's on failure
     setup_signals();
+    // Then take them through signal_fd, so every mode can drain
+    if (open_signal_fd()) {
+	exit(EXIT_FAILURE);
+    }
 
     // Set up the socket with socket, bind, listen calls
     // perror and exit's on failure.  If we return, sock_fd is valid
-    sock_fd = socket_init();
+    sock_fd = socket_init(config.port, config.listen_backlog,
+			  config.reuseport);
 
-    // Now that we have successfully determined that we can bind to the
-    // socket, call getopts to look for -d.
-    // See: https://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html
-    opterr = 0;			// Turn off getopt printfs
-    daemonize = 0;		// Assume not until we find -d in argv
-    while ((arg = getopt (argc, argv, "d")) != -1)
-	switch (arg)
-	{
-	case 'd':
-	    daemonize = 1;
-	    break;
-	// Ignore unknown opts and errors
-	case '?':
-	default:
-	    break;
-	}
+    // The uring loop has its own fixed set of connection slots, and the
+    // thread loop counts its connections itself.
+    if (((SERVER_MODE_EPOLL == config.mode) ||
+	 (SERVER_MODE_POOL == config.mode)) &&
+	init_conn_slots(config.max_connections)) {
+	goto close_sock_fd;
+    }
 
-    if (daemonize) {
+    // Now that we have successfully determined that we can bind to the
+    // socket, daemonize if asked to.
+    if (config.daemonize) {
 	PRINTF("Daemonize...\n");
 	// daemon(3) handles fork/setsid/chdir/redir of stdin/out/err to
 	// /dev/null.  It does not close other open fd's (our sockets
@@ -549,94 +4058,50 @@ int main(int argc, char *argv[])
 	// Now running in child...
     }
 
-    if (pthread_mutex_init(&datafile_mutex, NULL)) {
-	perror("pthread_mutex_init");
+    // File open/close pairing moved to threads in assignment 8
+    // so mod unload in QEMU will work; that's now the -r option, on
+    // by default for the aesdchar device, while a regular data file
+    // stays open.  datafile_init() deletes the old local file if not
+    // using aesdchar device.
+    if (datafile_init(&datafile, config.datafile_name, config.backend,
+		      config.reopen_datafile)) {
 	goto close_sock_fd;
     }
 
-    SLIST_INIT(&thread_list_head);
-
-#ifndef USE_AESD_CHAR_DEVICE
-    if (!(p_timestamp_thread_data =
-	  malloc(sizeof(struct timestamp_thread_data)))) {
-	perror("malloc");
+    if (server_thread_attr_init(&thread_attr)) {
 	goto close_sock_fd;
     }
 
-    p_timestamp_thread_data->p_file_mutex = &datafile_mutex;
-
-    if (pthread_create(&(p_timestamp_thread_data->thread_id), NULL,
-		       timestamp_thread, (void *) p_timestamp_thread_data)) {
-	perror("pthread_create");
-	goto free_thread_data;
-    } else {
-	PRINTF("timestamp pthread_create successful\n");
+    if (init_timestamp_timer(&datafile, config.timestamp_ms)) {
+	goto close_sock_fd;
     }
-#endif // USE_AESD_CHAR_DEVICE
-
-    while (1) {
-	conn_fd = wait_for_client_connection(sock_fd, client_ip_addr_str,
-					     client_port_str);
-
-	if (!(p_server_thread_data = malloc(sizeof(struct server_thread_data)))) {
-	    perror("malloc");
-	    goto close_conn_fd;
-	}
-
-	p_server_thread_data->p_file_mutex = &datafile_mutex;
-	p_server_thread_data->conn_fd      = conn_fd;
-	p_server_thread_data->sock_fd      = sock_fd;
-	p_server_thread_data->client_done  = 0;
-	strcpy(p_server_thread_data->client_ip_addr_str, client_ip_addr_str);
-	strcpy(p_server_thread_data->client_port_str, client_port_str);
-	
-	if (pthread_create(&(p_server_thread_data->thread_id), NULL,
-			   server_thread, (void *) p_server_thread_data)) {
-	    perror("pthread_create");
-	    goto free_thread_data;
-	} else {
-	    PRINTF("pthread_create successful, p_server_thread_data = %p\n",
-		   p_server_thread_data);
-	}
 
-	// Insert the thread_data structure into the list
-	SLIST_INSERT_HEAD(&thread_list_head, p_server_thread_data, entries);
-
-	// Now iterate over the list and join any that are done.
-	// This probably has a race condition - if the last thread
-	// completes while blocked in an accept, we will never join
-	// it.  This is probably the srouce of the "You may see one
-	// possibly lost message which looks like this, which it’s
-	// OK to ignore" message in the assignment.
-	SLIST_FOREACH(p_server_thread_data, &thread_list_head, entries) {
-	    PRINTF("SLIST_FOREACH p_server_thread_data = %p\n", p_server_thread_data);
-	    if (p_server_thread_data->client_done) break;
-	}
-
-	if (p_server_thread_data && p_server_thread_data->client_done) {
-	    SLIST_REMOVE(&thread_list_head, p_server_thread_data,
-			 server_thread_data, entries);
-	    PRINTF("Removed list element = %p\n", p_server_thread_data);
-
-	    // Join finished thread and cleanup previously allocated resources
-	    if (pthread_join(p_server_thread_data->thread_id, NULL)) {
-		perror("pthread_join");
-		goto free_thread_data;
-	    }
-	    shutdown(p_server_thread_data->conn_fd, SHUT_RDWR);
-	    close(p_server_thread_data->conn_fd);
-	    free(p_server_thread_data);
-	}
+    // Each loop returns 0 once it has drained on a signal
+    switch (config.mode) {
+    case SERVER_MODE_EPOLL:
+	loop_status = epoll_server_loop(sock_fd, &datafile, &config);
+	break;
+    case SERVER_MODE_POOL:
+	loop_status = pool_server_loop(sock_fd, &datafile, &config);
+	break;
+#ifdef USE_IO_URING
+    case SERVER_MODE_URING:
+	loop_status = uring_server_loop(sock_fd, &datafile, &config);
+	break;
+#endif // USE_IO_URING
+    default:
+	loop_status = thread_server_loop(sock_fd, &datafile, &thread_attr,
+					 &config);
+	break;
+    }
+    if (!loop_status) {
+	syslog(LOG_USER|LOG_INFO,"Caught signal, exiting");
+	exit_status = EXIT_SUCCESS;
     }
 
     // Goto's are bad.  But if they are good enough for error handling/
     // shutdown in the kernel, they're good enough for me.
-    // Should iterate and clear all server threads and also timestamp thread
-free_thread_data: free(p_server_thread_data);
-close_conn_fd:    shutdown(conn_fd, SHUT_RDWR); close(conn_fd);
 close_sock_fd:    close(sock_fd);
-#ifndef USE_AESD_CHAR_DEVICE
-    unlink(DATAFILE_NAME);
-#endif // USE_AESD_CHAR_DEVICE
+    datafile_remove(&datafile);
     exit(exit_status);
 }